@@ -0,0 +1,485 @@
+#include <build.h>
+
+#include <omp.h>
+#include <array>
+#include <cmath>
+#include <vector>
+#include <fstream>
+#include <utility>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#include <st.h>
+#include <fixed.h>
+#include <merge.h>
+#include <utils.h>
+
+using namespace std;
+
+namespace cma {
+
+/**
+ * Cells with fewer lines than this are not worth splitting any further.
+ */
+const size_t min_cell_lines = 256;
+
+line_order_type parse_line_order(const string& name)
+{
+    if (name == "id") {
+        return ORDER_ID;
+    }
+    if (name == "hilbert") {
+        return ORDER_HILBERT;
+    }
+    throw invalid_argument("unknown line order: " + name);
+}
+
+uint64_t hilbert_key(uint32_t x, uint32_t y, int order)
+{
+    const uint32_t n = uint32_t(1) << order;
+
+    uint64_t d = 0;
+    for (uint32_t s = n/2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += uint64_t(s) * s * ((3 * rx) ^ ry);
+
+        // rotate the quadrant
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n-1 - x;
+                y = n-1 - y;
+            }
+            swap(x, y);
+        }
+    }
+    return d;
+}
+
+void hilbert_sort(const OGREnvelope& envelope, linesV& lines)
+{
+    const int order = 16;
+    const double cells = double((uint32_t(1) << order) - 1);
+
+    double w = envelope.MaxX - envelope.MinX;
+    double h = envelope.MaxY - envelope.MinY;
+    double sx = w > 0 ? cells / w : 0.;
+    double sy = h > 0 ? cells / h : 0.;
+
+    auto to_grid = [cells](double v) {
+        return uint32_t(max(0., min(cells, floor(v))));
+    };
+
+    // compute keys once, sort (key, line) pairs
+    vector< pair<uint64_t, pair<int, GEOSGeometry*> > > keyed;
+    keyed.reserve(lines.size());
+    for (pair<int, GEOSGeometry*>& line_info : lines) {
+        vector<double> bbox;
+        uint64_t key = 0;
+        if (bounding_box(line_info.second, bbox)) {
+            double cx = (bbox[0] + bbox[2]) / 2;
+            double cy = (bbox[1] + bbox[3]) / 2;
+            key = hilbert_key(
+                to_grid((cx - envelope.MinX) * sx),
+                to_grid((cy - envelope.MinY) * sy),
+                order);
+        }
+        keyed.push_back(make_pair(key, line_info));
+    }
+
+    sort(keyed.begin(), keyed.end(), [](
+        const pair<uint64_t, pair<int, GEOSGeometry*> >& a,
+        const pair<uint64_t, pair<int, GEOSGeometry*> >& b) {
+        return a.first < b.first || (a.first == b.first && a.second.first < b.second.first);
+    });
+
+    for (size_t i = 0; i < keyed.size(); ++i) {
+        lines[i] = keyed[i].second;
+    }
+}
+
+/**
+ * Return a cleaned up and self-noded copy of a line or nullptr
+ * (along with the reason) if it is degenerate.
+ */
+GEOSGeometry* _prescreen_line(const GEOSGeometry* line, const char** reason)
+{
+    if (!line || GEOSisEmpty_r(hdl, line) == 1) {
+        *reason = "empty";
+        return nullptr;
+    }
+    if (GEOSGeomTypeId_r(hdl, line) != GEOS_LINESTRING) {
+        *reason = "not a linestring";
+        return nullptr;
+    }
+
+    const GEOSCoordSequence* seq = GEOSGeom_getCoordSeq_r(hdl, line);
+    unsigned int size;
+    GEOSCoordSeq_getSize_r(hdl, seq, &size);
+
+    // drop repeated points
+    vector<double> xs, ys;
+    xs.reserve(size);
+    ys.reserve(size);
+
+    double x, y;
+    for (unsigned int i = 0; i < size; ++i) {
+        GEOSCoordSeq_getX_r(hdl, seq, i, &x);
+        GEOSCoordSeq_getY_r(hdl, seq, i, &y);
+
+        if (!isfinite(x) || !isfinite(y)) {
+            *reason = "non-finite coordinates";
+            return nullptr;
+        }
+        if (!xs.empty() && xs.back() == x && ys.back() == y) {
+            continue;
+        }
+        xs.push_back(x);
+        ys.push_back(y);
+    }
+
+    if (xs.size() < 2) {
+        *reason = "collapsed to a point";
+        return nullptr;
+    }
+
+    GEOSCoordSequence* cleaned_seq = GEOSCoordSeq_create_r(hdl, xs.size(), 2);
+    for (int i = 0; i < xs.size(); ++i) {
+        GEOSCoordSeq_setX_r(hdl, cleaned_seq, i, xs[i]);
+        GEOSCoordSeq_setY_r(hdl, cleaned_seq, i, ys[i]);
+    }
+    GEOSGeometry* cleaned = GEOSGeom_createLineString_r(hdl, cleaned_seq);
+
+    if (fixed_grid()) {
+        GEOSGeometry* tmp = cleaned;
+        cleaned = snap_to_grid(cleaned);
+        GEOSGeom_destroy_r(hdl, tmp);
+
+        if (GEOSisEmpty_r(hdl, cleaned) == 1) {
+            GEOSGeom_destroy_r(hdl, cleaned);
+            *reason = "collapsed to a point";
+            return nullptr;
+        }
+    }
+
+    GEOSGeometry* noded = GEOSUnaryUnion_r(hdl, cleaned);
+    GEOSGeom_destroy_r(hdl, cleaned);
+
+    if (!noded) {
+        *reason = "cannot be noded";
+        return nullptr;
+    }
+
+    int type = GEOSGeomTypeId_r(hdl, noded);
+    if (GEOSisEmpty_r(hdl, noded) == 1 || (type != GEOS_LINESTRING && type != GEOS_MULTILINESTRING)) {
+        GEOSGeom_destroy_r(hdl, noded);
+        *reason = "collapsed while noding";
+        return nullptr;
+    }
+
+    GEOSSetSRID_r(hdl, noded, GEOSGetSRID_r(hdl, line));
+    return noded;
+}
+
+size_t prescreen_lines(linesV& lines)
+{
+    vector<GEOSGeometry*> prepared(lines.size(), nullptr);
+    vector<const char*> reasons(lines.size(), nullptr);
+
+    #pragma omp parallel
+    {
+        // each thread needs its own GEOS context
+        thread_geos();
+
+        #pragma omp for schedule(dynamic, 64)
+        for (size_t i = 0; i < lines.size(); ++i) {
+            prepared[i] = _prescreen_line(lines[i].second, &reasons[i]);
+            GEOSGeom_destroy_r(hdl, lines[i].second);
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        if (!prepared[i]) {
+            cerr << "Line id #" << lines[i].first << " skipped: " << reasons[i] << endl;
+            continue;
+        }
+        lines[kept++] = make_pair(lines[i].first, prepared[i]);
+    }
+
+    size_t removed = lines.size() - kept;
+    lines.resize(kept);
+
+    return removed;
+}
+
+/**
+ * Quarantine file path, lines exceeding their budget are not recorded if empty.
+ */
+static string quarantine_path;
+
+void set_quarantine_file(const string& path)
+{
+    quarantine_path = path;
+}
+
+/**
+ * Append "<line id> <hex WKB>" to the quarantine file.
+ */
+static void quarantine_line(int lineId, const GEOSGeometry* line)
+{
+    if (quarantine_path.empty()) {
+        return;
+    }
+
+    GEOSWKBWriter* writer = GEOSWKBWriter_create_r(hdl);
+    size_t size;
+    unsigned char* hex = GEOSWKBWriter_writeHEX_r(hdl, writer, line, &size);
+    GEOSWKBWriter_destroy_r(hdl, writer);
+
+    #pragma omp critical(quarantine)
+    {
+        ofstream out(quarantine_path, ios::app);
+        out << lineId << " ";
+        out.write((const char*)hex, size);
+        out << endl;
+    }
+    GEOSFree_r(hdl, hex);
+}
+
+/**
+ * Add lines one at a time. If quarantined is set, lines run with a budget
+ * and those exceeding it are rolled back and moved to quarantined instead
+ * of being destroyed.
+ */
+static bool add_lines_pass(
+    Topology* topology,
+    linesV& lines,
+    double tolerance,
+    bool prenoded,
+    linesV* quarantined)
+{
+    bool complete = true;
+    for (pair<int, GEOSGeometry*>& line_info : lines) {
+        int lineId = line_info.first;
+        GEOSGeometry* line = line_info.second;
+
+        if (complete) {
+            try {
+                topology->TopoGeo_AddLineString(lineId, line, tolerance, prenoded, quarantined != nullptr);
+                topology->commit();
+            }
+            catch (const line_budget_exceeded& ex) {
+                cerr << "Line " << lineId << ": " << ex.what() << ", quarantined" << endl;
+                topology->rollback();
+                quarantine_line(lineId, line);
+                quarantined->push_back(line_info);
+                continue;
+            }
+            catch (const runtime_error& ex) {
+                cerr << "Line #" << topology->count() << " - " << thread_geos()->as_string(line) << ": " << ex.what() << endl;
+                topology->rollback();
+                complete = false;
+            }
+            catch (const invalid_argument& ex) {
+                cerr << "Line #" << topology->count() << " - " << thread_geos()->as_string(line) << ": " << ex.what() << endl;
+                topology->rollback();
+            }
+        }
+
+        GEOSGeom_destroy_r(hdl, line);
+    }
+    lines.clear();
+
+    return complete;
+}
+
+bool add_lines(Topology* topology, linesV& lines, double tolerance, bool prenoded)
+{
+    assert (topology);
+
+    if (Topology::line_budget() <= 0) {
+        return add_lines_pass(topology, lines, tolerance, prenoded, nullptr);
+    }
+
+    linesV quarantined;
+    bool complete = add_lines_pass(topology, lines, tolerance, prenoded, &quarantined);
+
+    // dedicated pass for the quarantined lines, without budget
+    if (!quarantined.empty()) {
+        cerr << "Retrying " << quarantined.size() << " quarantined line(s)" << endl;
+        if (complete) {
+            complete = add_lines_pass(topology, quarantined, tolerance, prenoded, nullptr);
+        }
+        else {
+            for (pair<int, GEOSGeometry*>& line_info : quarantined) {
+                GEOSGeom_destroy_r(hdl, line_info.second);
+            }
+        }
+    }
+
+    return complete;
+}
+
+bool bulk_add_lines(Topology* topology, linesV& lines, double tolerance)
+{
+    assert (topology);
+
+    try {
+        topology->bulk_load(lines, tolerance);
+    }
+    catch (const runtime_error& ex) {
+        cerr << ex.what() << endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Split an envelope into its 4 quadrants.
+ */
+void _split_envelope(const OGREnvelope& envelope, array<OGREnvelope, 4>& quadrants)
+{
+    double midX = (envelope.MinX + envelope.MaxX) / 2;
+    double midY = (envelope.MinY + envelope.MaxY) / 2;
+
+    for (int i = 0; i < 4; ++i) {
+        OGREnvelope& q = quadrants[i];
+        q.MinX = i % 2 == 0 ? envelope.MinX : midX;
+        q.MaxX = i % 2 == 0 ? midX : envelope.MaxX;
+        q.MinY = i < 2 ? envelope.MinY : midY;
+        q.MaxY = i < 2 ? midY : envelope.MaxY;
+    }
+}
+
+/**
+ * Return the quadrant fully containing the line and its tolerance
+ * or -1 if the line straddles them.
+ */
+int _find_quadrant(const array<OGREnvelope, 4>& quadrants, const GEOSGeometry* line, double tolerance)
+{
+    vector<double> bbox;
+    if (!bounding_box(const_cast<GEOSGeometry*>(line), bbox)) {
+        return -1;
+    }
+
+    OGREnvelope env;
+    env.MinX = bbox[0] - tolerance;
+    env.MinY = bbox[1] - tolerance;
+    env.MaxX = bbox[2] + tolerance;
+    env.MaxY = bbox[3] + tolerance;
+
+    for (int i = 0; i < 4; ++i) {
+        if (quadrants[i].Contains(env)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+Topology* _build_cell(
+    const OGREnvelope& envelope,
+    linesV& lines,
+    int depth,
+    double tolerance,
+    bool prenoded)
+{
+    GEOSHelper* geos = thread_geos();
+
+    if (depth == 0 || lines.size() < min_cell_lines) {
+        Topology* topology = new Topology(geos);
+        if (!add_lines(topology, lines, tolerance, prenoded)) {
+            delete topology;
+            return nullptr;
+        }
+        return topology;
+    }
+
+    array<OGREnvelope, 4> quadrants;
+    _split_envelope(envelope, quadrants);
+
+    array<linesV, 4> cell_lines;
+    linesV straddling;
+    for (pair<int, GEOSGeometry*>& line_info : lines) {
+        int q = _find_quadrant(quadrants, line_info.second, tolerance);
+        if (q >= 0) {
+            cell_lines[q].push_back(line_info);
+        }
+        else {
+            straddling.push_back(line_info);
+        }
+    }
+    lines.clear();
+
+    Topology* children[4] = {nullptr, nullptr, nullptr, nullptr};
+    for (int i = 0; i < 4; ++i) {
+        #pragma omp task shared(children, quadrants, cell_lines) firstprivate(i)
+        children[i] = _build_cell(quadrants[i], cell_lines[i], depth-1, tolerance, prenoded);
+    }
+    #pragma omp taskwait
+
+    bool complete = true;
+    for (int i = 0; i < 4; ++i) {
+        complete = complete && children[i];
+    }
+
+    if (!complete) {
+        for (int i = 0; i < 4; ++i) {
+            delete children[i];
+        }
+        for (pair<int, GEOSGeometry*>& line_info : straddling) {
+            GEOSGeom_destroy_r(hdl, line_info.second);
+        }
+        return nullptr;
+    }
+
+    // sub-cells are independent, merge them just like zones
+    Topology* topology = children[0];
+    for (int i = 1; i < 4; ++i) {
+        merge_topologies(*topology, *children[i]);
+        delete children[i];
+    }
+
+    if (straddling.empty()) {
+        return topology;
+    }
+
+    if (!topology->indexed()) {
+        topology->rebuild_indexes();
+    }
+    if (!add_lines(topology, straddling, tolerance, prenoded)) {
+        delete topology;
+        return nullptr;
+    }
+
+    return topology;
+}
+
+Topology* build_topology(
+    const OGREnvelope& envelope,
+    linesV& lines,
+    int depth,
+    double tolerance,
+    bool prenoded)
+{
+    Topology* topology = nullptr;
+    GEOSHelper* geos = thread_geos();
+
+    #pragma omp parallel
+    {
+        #pragma omp single
+        topology = _build_cell(envelope, lines, depth, tolerance, prenoded);
+    }
+
+    // cells were built with the helpers of the threads which ran them
+    if (topology) {
+        topology->set_geos(geos);
+    }
+
+    assert (lines.empty());
+    return topology;
+}
+
+} // namespace cma
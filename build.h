@@ -0,0 +1,105 @@
+#ifndef __CMA_BUILD_H
+#define __CMA_BUILD_H
+
+#include <string>
+#include <cstdint>
+#include <ogrsf_frmts.h>
+
+#include <types.h>
+#include <topology.h>
+
+namespace cma {
+
+/**
+ * Order in which lines are added to a zone topology.
+ */
+typedef enum {
+    ORDER_ID,           // as returned by the database (ORDER BY id)
+    ORDER_HILBERT       // along a Hilbert curve covering the zone
+} line_order_type;
+
+/**
+ * Parse a line order name ("id" or "hilbert").
+ */
+line_order_type parse_line_order(const std::string& name);
+
+/**
+ * Return the distance of (x, y) along a Hilbert curve filling
+ * a 2^order x 2^order grid.
+ */
+uint64_t hilbert_key(uint32_t x, uint32_t y, int order=16);
+
+/**
+ * Sort lines by the Hilbert key of their envelope centroid on a 2^16 x 2^16
+ * grid covering the given envelope so that consecutive insertions touch
+ * neighbouring edges, nodes and faces. Ties are broken by line id.
+ */
+void hilbert_sort(const OGREnvelope& envelope, linesV& lines);
+
+/**
+ * Pre-screen lines on the OpenMP thread pool ahead of their insertion.
+ *
+ * Repeated points are removed (and coordinates snapped in fixed grid mode),
+ * then every line is self-noded so that it can be added as prenoded.
+ * Degenerate lines (empty, non-finite coordinates, collapsed to a point or
+ * that cannot be noded) are destroyed and removed from lines right away
+ * instead of failing deep in the insertion and forcing a rollback.
+ * Order is preserved. Returns the number of lines removed.
+ */
+size_t prescreen_lines(linesV& lines);
+
+/**
+ * Add lines to a topology one at a time, committing after each of them.
+ *
+ * Lines are destroyed as they get consumed. Lines which cannot be added
+ * (invalid_argument) are rolled back and skipped. Returns false if the
+ * topology could not be completed (runtime_error), remaining lines are
+ * destroyed anyway.
+ *
+ * When a line budget is configured (Topology::line_budget()), lines running
+ * past it are rolled back, recorded to the quarantine file and retried
+ * without budget once all other lines have been added.
+ */
+bool add_lines(
+    Topology* topology,
+    linesV& lines,
+    double tolerance=DEFAULT_TOLERANCE,
+    bool prenoded=false);
+
+/**
+ * Set the file add_lines() appends quarantined lines to, one
+ * "<line id> <hex WKB>" record per line (default: none).
+ */
+void set_quarantine_file(const std::string& path);
+
+/**
+ * Same as add_lines() for an empty topology, using Topology::bulk_load()
+ * instead of adding lines one at a time.
+ */
+bool bulk_add_lines(
+    Topology* topology,
+    linesV& lines,
+    double tolerance=DEFAULT_TOLERANCE);
+
+/**
+ * Build the topology of a zone on the OpenMP thread pool.
+ *
+ * The zone envelope is recursively split into 4 sub-cells, depth times.
+ * Every line goes to the deepest cell containing it (tolerance included),
+ * leaf cells are built as independent tasks and each parent cell merges its
+ * children with merge_topologies() before adding the lines straddling them,
+ * the same way orphans are added when merging zones.
+ *
+ * Lines are destroyed. The topology uses the GEOSHelper of the calling
+ * thread. Returns nullptr if the topology could not be completed.
+ */
+Topology* build_topology(
+    const OGREnvelope& envelope,
+    linesV& lines,
+    int depth,
+    double tolerance=DEFAULT_TOLERANCE,
+    bool prenoded=false);
+
+} // namespace cma
+
+#endif // __CMA_BUILD_H
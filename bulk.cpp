@@ -0,0 +1,365 @@
+#include <topology.h>
+
+#include <map>
+#include <set>
+#include <cmath>
+#include <cassert>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+
+#include <st.h>
+#include <fixed.h>
+
+using namespace std;
+
+namespace bgi = boost::geometry::index;
+
+namespace cma {
+
+/**
+ * Bulk planar graph construction of an empty topology.
+ *
+ * Instead of adding lines one at a time (each of them being snapped and
+ * noded against the existing edges and nodes), all lines are snapped to
+ * each other, noded in a single union and the resulting planar graph is
+ * loaded as is: nodes at every piece endpoint, next_left/next_right links
+ * from the azimuth sorted edge star of every node and faces from a single
+ * ring traversal (see build_faces()).
+ */
+
+typedef pair<double, double> _xy_t;
+typedef vector<_xy_t> _coords_t;
+
+void _line_coords(const GEOSGeometry* line, _coords_t& coords)
+{
+    const GEOSCoordSequence* seq = GEOSGeom_getCoordSeq_r(hdl, line);
+    unsigned int size;
+    GEOSCoordSeq_getSize_r(hdl, seq, &size);
+
+    coords.resize(size);
+    for (unsigned int i = 0; i < size; ++i) {
+        GEOSCoordSeq_getX_r(hdl, seq, i, &coords[i].first);
+        GEOSCoordSeq_getY_r(hdl, seq, i, &coords[i].second);
+    }
+}
+
+GEOSGeometry* _make_line(_coords_t::const_iterator first, _coords_t::const_iterator last, int srid)
+{
+    GEOSCoordSequence* seq = GEOSCoordSeq_create_r(hdl, distance(first, last), 2);
+    unsigned int i = 0;
+    for (auto it = first; it != last; ++it, ++i) {
+        GEOSCoordSeq_setX_r(hdl, seq, i, it->first);
+        GEOSCoordSeq_setY_r(hdl, seq, i, it->second);
+    }
+
+    GEOSGeometry* line = GEOSGeom_createLineString_r(hdl, seq);
+    GEOSSetSRID_r(hdl, line, srid);
+    return line;
+}
+
+/**
+ * Snap every vertex to the closest vertex of another line within tolerance,
+ * vertices of the first lines winning, as when lines are added in order.
+ * A line is never snapped to itself.
+ */
+void _cluster_vertices(vector< vector<_coords_t> >& lines, double tolerance)
+{
+    typedef pair<point, int> vertex_value;
+    bgi::rtree< vertex_value, bgi::rstar<16> > vertex_idx;
+    vector<int> owners;
+
+    for (int lineIdx = 0; lineIdx < lines.size(); ++lineIdx) {
+        for (_coords_t& part : lines[lineIdx]) {
+            for (_xy_t& xy : part) {
+                box env(
+                    point(xy.first - tolerance, xy.second - tolerance),
+                    point(xy.first + tolerance, xy.second + tolerance)
+                );
+
+                vector<vertex_value> candidates;
+                vertex_idx.query(bgi::intersects(env), back_inserter(candidates));
+
+                double closest = tolerance;
+                const point* snap = nullptr;
+                bool known = false;
+                for (const vertex_value& v : candidates) {
+                    double dx = v.first.x() - xy.first;
+                    double dy = v.first.y() - xy.second;
+                    double d = sqrt(dx*dx + dy*dy);
+
+                    known = known || d == 0.;
+                    if (owners[v.second] != lineIdx && d <= closest) {
+                        closest = d;
+                        snap = &v.first;
+                    }
+                }
+
+                if (snap) {
+                    xy = _xy_t(snap->x(), snap->y());
+                }
+                else if (!known) {
+                    vertex_idx.insert(make_pair(point(xy.first, xy.second), owners.size()));
+                    owners.push_back(lineIdx);
+                }
+            }
+
+            part.erase(unique(part.begin(), part.end()), part.end());
+        }
+
+        lines[lineIdx].erase(
+            remove_if(lines[lineIdx].begin(), lines[lineIdx].end(), [](const _coords_t& part) {
+                return part.size() < 2;
+            }),
+            lines[lineIdx].end()
+        );
+    }
+}
+
+void Topology::bulk_load(linesV& lines, double tolerance)
+{
+    assert (_transactions->empty());
+    assert (_nodes.size() == 1 && _edges.size() == 1 && _faces.size() == 1);
+
+    int srid = lines.empty() ? 0 : GEOSGetSRID_r(hdl, lines[0].second);
+
+    // 1. Snap lines to each other
+    vector< vector<_coords_t> > parts(lines.size());
+    for (int i = 0; i < lines.size(); ++i) {
+        GEOSGeometry* line = lines[i].second;
+        if (fixed_grid()) {
+            line = snap_to_grid(line);
+        }
+
+        for (int j = 0; j < GEOSGetNumGeometries_r(hdl, line); ++j) {
+            const GEOSGeometry* g = GEOSGetGeometryN_r(hdl, line, j);
+            if (GEOSGeomTypeId_r(hdl, g) != GEOS_LINESTRING || GEOSisEmpty_r(hdl, g) == 1) {
+                continue;
+            }
+            parts[i].push_back(_coords_t());
+            _line_coords(g, parts[i].back());
+        }
+
+        if (line != lines[i].second) {
+            GEOSGeom_destroy_r(hdl, line);
+        }
+        GEOSGeom_destroy_r(hdl, lines[i].second);
+        lines[i].second = nullptr;
+    }
+
+    if (tolerance > 0.) {
+        _cluster_vertices(parts, tolerance);
+    }
+
+    // snapped lines are kept to find the edges they are made of
+    vector<GEOSGeometry*> snapped(lines.size());
+    vector<GEOSGeometry*> all_parts;
+    set<_xy_t> node_coords;
+    for (int i = 0; i < lines.size(); ++i) {
+        vector<GEOSGeometry*> geoms;
+        for (const _coords_t& part : parts[i]) {
+            geoms.push_back(_make_line(part.begin(), part.end(), srid));
+            all_parts.push_back(GEOSGeom_clone_r(hdl, geoms.back()));
+            node_coords.insert(part.front());
+            node_coords.insert(part.back());
+        }
+        snapped[i] = GEOSGeom_createCollection_r(hdl, GEOS_MULTILINESTRING, geoms.data(), geoms.size());
+    }
+    parts.clear();
+
+    // 2. Node all lines at once, overlapping segments are dissolved
+    GEOSGeometry* collection = GEOSGeom_createCollection_r(hdl, GEOS_MULTILINESTRING, all_parts.data(), all_parts.size());
+    // on the grid, intersection points are rounded and noded again
+    GEOSGeometry* noded = fixed_grid() ? node_on_grid(collection) : GEOSUnaryUnion_r(hdl, collection);
+    GEOSGeom_destroy_r(hdl, collection);
+
+    if (!noded) {
+        for (GEOSGeometry* g : snapped) {
+            GEOSGeom_destroy_r(hdl, g);
+        }
+        lines.clear();
+        throw runtime_error("bulk_load: lines cannot be noded");
+    }
+
+    vector<_coords_t> pieces;
+    for (int i = 0; i < GEOSGetNumGeometries_r(hdl, noded); ++i) {
+        const GEOSGeometry* g = GEOSGetGeometryN_r(hdl, noded, i);
+        if (GEOSGeomTypeId_r(hdl, g) != GEOS_LINESTRING || GEOSisEmpty_r(hdl, g) == 1) {
+            continue;
+        }
+
+        pieces.push_back(_coords_t());
+        _line_coords(g, pieces.back());
+        node_coords.insert(pieces.back().front());
+        node_coords.insert(pieces.back().back());
+    }
+    GEOSGeom_destroy_r(hdl, noded);
+
+    // 3. Nodes and edges. Pieces going through a line endpoint are split
+    //    there and duplicate pieces are skipped.
+    map<_xy_t, int> node_ids;
+    set<_coords_t> known_edges;
+
+    auto get_node = [&](const _xy_t& xy) {
+        auto it = node_ids.find(xy);
+        if (it != node_ids.end()) {
+            return it->second;
+        }
+
+        GEOSCoordSequence* seq = GEOSCoordSeq_create_r(hdl, 1, 2);
+        GEOSCoordSeq_setX_r(hdl, seq, 0, xy.first);
+        GEOSCoordSeq_setY_r(hdl, seq, 0, xy.second);
+
+        node* n = new node;
+        n->id = _nodes.size();
+        n->set_geom(GEOSGeom_createPoint_r(hdl, seq));
+        GEOSSetSRID_r(hdl, n->geom, srid);
+        _nodes.push_back(n);
+
+        node_ids[xy] = n->id;
+        return n->id;
+    };
+
+    auto add_piece = [&](_coords_t::const_iterator first, _coords_t::const_iterator last) {
+        _coords_t key(first, last);
+        _coords_t reversed(key.rbegin(), key.rend());
+        if (reversed < key) {
+            key.swap(reversed);
+        }
+        if (key.size() < 2 || !known_edges.insert(key).second) {
+            return;
+        }
+
+        edge* e = new edge;
+        e->id = _edges.size();
+        e->start_node = get_node(*first);
+        e->end_node = get_node(*(last-1));
+        e->left_face = 0;
+        e->right_face = 0;
+        e->set_geom(_make_line(first, last, srid));
+        _edges.push_back(e);
+    };
+
+    for (const _coords_t& piece : pieces) {
+        auto first = piece.begin();
+        for (auto it = piece.begin() + 1; it != piece.end() - 1; ++it) {
+            if (node_coords.count(*it)) {
+                add_piece(first, it+1);
+                first = it;
+            }
+        }
+        add_piece(first, piece.end());
+    }
+    pieces.clear();
+    known_edges.clear();
+
+    // 4. Edge links from the star of every node: going around a node
+    //    clockwise, the edge following an incoming edge is its next one.
+    vector< vector< pair<double, int> > > stars(_nodes.size());
+    for (const edge* e : _edges) {
+        if (!e) continue;
+
+        _coords_t coords;
+        _line_coords(e->geom, coords);
+
+        const _xy_t& s0 = coords[0];
+        const _xy_t& s1 = coords[1];
+        const _xy_t& e0 = coords[coords.size()-1];
+        const _xy_t& e1 = coords[coords.size()-2];
+
+        // same as ST_Azimuth(): clockwise from the north, in [0, 2pi[
+        double saz = atan2(s1.first - s0.first, s1.second - s0.second);
+        double eaz = atan2(e1.first - e0.first, e1.second - e0.second);
+        stars[e->start_node].push_back(make_pair(saz < 0 ? saz + 2*M_PI : saz, e->id));
+        stars[e->end_node].push_back(make_pair(eaz < 0 ? eaz + 2*M_PI : eaz, -e->id));
+    }
+
+    for (vector< pair<double, int> >& star : stars) {
+        sort(star.begin(), star.end());
+
+        for (size_t i = 0; i < star.size(); ++i) {
+            int edgeId = star[i].second;
+            int next = star[(i+1) % star.size()].second;
+
+            edge* e = _edges[abs(edgeId)];
+            if (edgeId < 0) {
+                e->next_left_edge = next;
+            }
+            else {
+                e->next_right_edge = next;
+            }
+        }
+    }
+    stars.clear();
+    _rebuild_links();
+
+    // 5. Faces
+    _stale_faces = true;
+    build_faces();
+
+    // 6. Relations: every edge a line was noded into lies on it
+    vector<edge_value> edge_values;
+    for (const edge* e : _edges) {
+        if (!e) continue;
+
+        vector<double> bbox;
+        bounding_box(e->geom, bbox);
+        edge_values.push_back(make_pair(box(point(bbox[0], bbox[1]), point(bbox[2], bbox[3])), e->id));
+    }
+    bgi::rtree< edge_value, bgi::rstar<16> > edge_idx(edge_values.begin(), edge_values.end());
+
+    for (int i = 0; i < lines.size(); ++i) {
+        int lineId = lines[i].first;
+        GEOSGeometry* line = snapped[i];
+
+        ++_totalCount;
+
+        int topogeoId = _relations.size();
+        _relations.push_back(nullptr);
+
+        vector<double> bbox;
+        if (bounding_box(line, bbox)) {
+            double eps = max(_ST_MinTolerance(line), grid_size());
+            box env(point(bbox[0] - eps, bbox[1] - eps), point(bbox[2] + eps, bbox[3] + eps));
+
+            edge_values.clear();
+            edge_idx.query(bgi::intersects(env), back_inserter(edge_values));
+            sort(edge_values.begin(), edge_values.end(), [](const edge_value& a, const edge_value& b) {
+                return a.second < b.second;
+            });
+
+            for (const edge_value& v : edge_values) {
+                // the middle of its first segment is never a node
+                const edge* e = _edges[v.second];
+                _coords_t coords;
+                _line_coords(e->geom, coords);
+
+                GEOSCoordSequence* seq = GEOSCoordSeq_create_r(hdl, 1, 2);
+                GEOSCoordSeq_setX_r(hdl, seq, 0, (coords[0].first + coords[1].first) / 2);
+                GEOSCoordSeq_setY_r(hdl, seq, 0, (coords[0].second + coords[1].second) / 2);
+                GEOSGeometry* probe = GEOSGeom_createPoint_r(hdl, seq);
+
+                if (ST_DWithin(probe, line, eps)) {
+                    relation* r = new relation;
+                    r->topogeo_id = topogeoId;
+                    r->layer_id = 1;
+                    r->element_id = e->id;
+                    r->element_type = 2;     // LINESTRING
+
+                    add_relation(topogeoId, r);
+                }
+                GEOSGeom_destroy_r(hdl, probe);
+            }
+        }
+        GEOSGeom_destroy_r(hdl, line);
+
+        assert (_topogeom_relations->count(lineId) == 0);
+        (*_topogeom_relations)[lineId] = topogeoId;
+    }
+    lines.clear();
+
+    commit();
+    rebuild_indexes();
+}
+
+} // namespace cma
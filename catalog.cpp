@@ -0,0 +1,229 @@
+#include <catalog.h>
+
+#include <map>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <cassert>
+#include <fstream>
+#include <iostream>
+
+#include <boost/geometry.hpp>
+#include <boost/geometry/index/rtree.hpp>
+
+using namespace std;
+
+namespace bg = boost::geometry;
+namespace bgi = boost::geometry::index;
+
+namespace cma {
+
+typedef bg::model::point<double, 2, bg::cs::cartesian> catalog_point;
+typedef bg::model::box<catalog_point> catalog_box;
+typedef pair<catalog_box, int> catalog_value;
+
+line_catalog& line_catalog::instance()
+{
+    static line_catalog catalog;
+    return catalog;
+}
+
+static array<double, 4> to_array(const OGREnvelope& envelope)
+{
+    return {{ envelope.MinX, envelope.MinY, envelope.MaxX, envelope.MaxY }};
+}
+
+/**
+ * FNV-1a hash of a value.
+ */
+template <class T>
+static uint64_t hash_bytes(const T& value, uint64_t h = 14695981039346656037ULL)
+{
+    const unsigned char* p = (const unsigned char*)&value;
+    for (size_t i = 0; i < sizeof(value); ++i) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+uint64_t line_catalog::fingerprint(
+    const vector<zone*>& zones,
+    const vector<depth_group_t>& groups,
+    uint64_t line_count)
+{
+    // summed so that the order of zones and of groups of the same depth does not matter
+    uint64_t h = hash_bytes(line_count);
+    for (const zone* z : zones) {
+        h += hash_bytes(to_array(z->envelope()), hash_bytes(z->id()));
+    }
+    for (const depth_group_t& g : groups) {
+        h += hash_bytes(g.second, hash_bytes(g.first));
+    }
+    return h;
+}
+
+bool line_catalog::build(
+    PG& db,
+    const vector<zone*>& zones,
+    const vector<depth_group_t>& groups,
+    uint64_t fingerprint,
+    const string& filename)
+{
+    auto start = chrono::steady_clock::now();
+
+    // zones, then merged zones of the groups in merge order
+    vector<OGREnvelope> envelopes;
+    map<int, int> current;      // zone id -> envelope index
+    for (const zone* z : zones) {
+        current[z->id()] = envelopes.size();
+        envelopes.push_back(z->envelope());
+    }
+    for (const depth_group_t& g : groups) {
+        OGREnvelope merged = envelopes[current.at(g.second[0])];
+        for (int i = 1; i < 4; ++i) {
+            merged.Merge(envelopes[current.at(g.second[i])]);
+        }
+        current[g.second[0]] = envelopes.size();
+        envelopes.push_back(merged);
+    }
+
+    bgi::rtree< catalog_value, bgi::quadratic<16> > idx;
+    for (int i = 0; i < envelopes.size(); ++i) {
+        const OGREnvelope& e = envelopes[i];
+        idx.insert(make_pair(catalog_box(catalog_point(e.MinX, e.MinY), catalog_point(e.MaxX, e.MaxY)), i));
+    }
+
+    vector< vector<int> > ids(envelopes.size());
+    size_t unassigned = 0;
+    vector<catalog_value> results;
+    bool ok = db.for_each_line_box([&](int id, const double* b) {
+        catalog_box lb(catalog_point(b[0], b[1]), catalog_point(b[2], b[3]));
+
+        results.clear();
+        idx.query(bgi::covers(lb), back_inserter(results));
+
+        // smallest zone containing the line
+        int best = -1;
+        double bestArea = numeric_limits<double>::max();
+        for (const catalog_value& v : results) {
+            double area = bg::area(v.first);
+            if (area < bestArea) {
+                bestArea = area;
+                best = v.second;
+            }
+        }
+
+        if (best < 0) {
+            ++unassigned;
+            return;
+        }
+        ids[best].push_back(id);
+    });
+
+    if (!ok) {
+        return false;
+    }
+
+    ofstream ofs(filename, ios::binary);
+    if (!ofs.is_open()) {
+        return false;
+    }
+
+    ofs.write((const char*)&fingerprint, sizeof(fingerprint));
+
+    uint64_t count = envelopes.size();
+    ofs.write((const char*)&count, sizeof(count));
+
+    uint64_t offset = 0;
+    for (int i = 0; i < envelopes.size(); ++i) {
+        sort(ids[i].begin(), ids[i].end());
+
+        entry e { to_array(envelopes[i]), offset, ids[i].size() };
+        ofs.write((const char*)&e, sizeof(e));
+        offset += e.count;
+    }
+    for (const vector<int>& v : ids) {
+        ofs.write((const char*)v.data(), v.size() * sizeof(int));
+    }
+    ofs.close();
+
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+    cout << "line catalog: " << offset << " lines assigned to " << count << " zones, "
+         << unassigned << " outside of all zones, saved to " << filename
+         << " (took: " << elapsed.count() << " ms)" << endl;
+
+    return true;
+}
+
+bool line_catalog::open(const string& filename, uint64_t fingerprint)
+{
+    _filename.clear();
+    _entries.clear();
+
+    ifstream ifs(filename, ios::binary);
+    if (!ifs.is_open()) {
+        return false;
+    }
+
+    uint64_t built_for;
+    if (!ifs.read((char*)&built_for, sizeof(built_for)) || built_for != fingerprint) {
+        return false;
+    }
+
+    uint64_t count;
+    if (!ifs.read((char*)&count, sizeof(count))) {
+        return false;
+    }
+
+    _entries.resize(count);
+    if (!ifs.read((char*)_entries.data(), count * sizeof(entry))) {
+        _entries.clear();
+        return false;
+    }
+
+    _ids_start = sizeof(built_for) + sizeof(count) + count * sizeof(entry);
+    _filename = filename;
+    return true;
+}
+
+const line_catalog::entry* line_catalog::_find(const OGREnvelope& envelope) const
+{
+    array<double, 4> key = to_array(envelope);
+    auto it = find_if(_entries.begin(), _entries.end(), [&key](const entry& e) {
+        return e.envelope == key;
+    });
+    return it == _entries.end() ? nullptr : &*it;
+}
+
+bool line_catalog::lines(const OGREnvelope& envelope, vector<int>& ids) const
+{
+    assert (is_open());
+
+    const entry* it = _find(envelope);
+    if (!it) {
+        return false;
+    }
+
+    ids.resize(it->count);
+    if (it->count == 0) {
+        return true;
+    }
+
+    ifstream ifs(_filename, ios::binary);
+    ifs.seekg(_ids_start + it->offset * sizeof(int));
+    return bool(ifs.read((char*)ids.data(), it->count * sizeof(int)));
+}
+
+bool line_catalog::count(const OGREnvelope& envelope, uint64_t& count) const
+{
+    assert (is_open());
+
+    const entry* it = _find(envelope);
+    if (!it) {
+        return false;
+    }
+    count = it->count;
+    return true;
+}
+
+} // namespace cma
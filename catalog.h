@@ -0,0 +1,93 @@
+#ifndef __CMA_CATALOG_H
+#define __CMA_CATALOG_H
+
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ogrsf_frmts.h>
+
+#include <pg.h>
+#include <types.h>
+#include <zones.h>
+
+namespace cma {
+
+/**
+ * Assignment of every line to the smallest zone of the merge hierarchy
+ * fully containing it: a zone built from its lines or the merged zone of
+ * a group, the line being then one of the group orphans.
+ *
+ * It is computed once at planning time from the line bounding boxes and
+ * saved to a binary file made of the fingerprint of the hierarchy and line
+ * count it was built for, a table of hierarchy zones (envelope, offset and
+ * count of their line ids) then the line ids sorted by zone then id, so
+ * that each zone reads back its own id range only.
+ */
+class line_catalog
+{
+public:
+    /**
+     * Catalog of the process.
+     */
+    static line_catalog& instance();
+
+    /**
+     * Fingerprint of the zones, groups and line count of a catalog: a
+     * catalog built for other zones or lines no longer matches it.
+     */
+    static uint64_t fingerprint(
+        const std::vector<zone*>& zones,
+        const std::vector<depth_group_t>& groups,
+        uint64_t line_count);
+
+    /**
+     * Compute the catalog of zones and groups (ordered by depth, deepest
+     * first) and save it to filename with their fingerprint.
+     */
+    static bool build(
+        PG& db,
+        const std::vector<zone*>& zones,
+        const std::vector<depth_group_t>& groups,
+        uint64_t fingerprint,
+        const std::string& filename);
+
+    /**
+     * Load the zone table of a catalog file, line ids stay on disk.
+     * Returns false if it was built with another fingerprint.
+     */
+    bool open(const std::string& filename, uint64_t fingerprint);
+
+    bool is_open() const {
+        return !_filename.empty();
+    }
+
+    /**
+     * Ids (sorted) of the lines assigned to the zone of the hierarchy with
+     * this exact envelope. Returns false if there is no such zone.
+     */
+    bool lines(const OGREnvelope& envelope, std::vector<int>& ids) const;
+
+    /**
+     * Number of lines assigned to the zone with this exact envelope, without
+     * reading their ids. Returns false if there is no such zone.
+     */
+    bool count(const OGREnvelope& envelope, uint64_t& count) const;
+
+private:
+    struct entry {
+        std::array<double, 4> envelope;     // minx, miny, maxx, maxy
+        uint64_t offset;                    // in ids, from the start of the id section
+        uint64_t count;
+    };
+
+    std::string _filename;
+    std::vector<entry> _entries;
+    uint64_t _ids_start = 0;                // byte offset of the id section
+
+    const entry* _find(const OGREnvelope& envelope) const;
+};
+
+} // namespace cma
+
+#endif // __CMA_CATALOG_H
@@ -0,0 +1,74 @@
+#include <cost.h>
+
+#include <cmath>
+#include <cassert>
+
+#include <catalog.h>
+
+using namespace std;
+
+namespace cma {
+
+merge_work merge_cost_model::work(const vector<zone*>& children) const
+{
+    assert (!children.empty());
+
+    merge_work w;
+    OGREnvelope envelope = children[0]->envelope();
+    for (const zone* z : children) {
+        envelope.Merge(z->envelope());
+        w.lines += z->count();
+    }
+
+    if (!line_catalog::instance().is_open() || !line_catalog::instance().count(envelope, w.orphans)) {
+        double ratio = _lines > 0 ? _orphans / _lines : 0.01;
+        w.orphans = uint64_t(ratio * w.lines);
+    }
+    return w;
+}
+
+void merge_cost_model::observe(const merge_work& w, uint64_t orphans, double seconds)
+{
+    _lines += w.lines;
+    _orphans += orphans;
+
+    // fit on the actual orphan count, predictions only guess it
+    double l = w.lines;
+    double o = orphans;
+    _sll += l * l;
+    _slo += l * o;
+    _soo += o * o;
+    _sls += l * seconds;
+    _sos += o * seconds;
+    ++_samples;
+
+    double det = _sll * _soo - _slo * _slo;
+    if (_samples >= 2 && det > 1e-9 * _sll * _soo) {
+        double line_rate = (_sls * _soo - _sos * _slo) / det;
+        double orphan_rate = (_sos * _sll - _sls * _slo) / det;
+        if (line_rate >= 0 && orphan_rate >= 0) {
+            _line_rate = line_rate;
+            _orphan_rate = orphan_rate;
+            return;
+        }
+    }
+
+    merge_work actual = w;
+    actual.orphans = orphans;
+    double predicted = predict(actual);
+    if (predicted > 0 && seconds > 0) {
+        // smooth the correction, single merges are noisy
+        double scale = sqrt(seconds / predicted);
+        _line_rate *= scale;
+        _orphan_rate *= scale;
+    }
+}
+
+void merge_cost_model::print(ostream& os) const
+{
+    os << "merge cost model -- " << _line_rate * 1e6 << " us/line, " << _orphan_rate * 1e3
+       << " ms/orphan, " << (_lines > 0 ? _orphans / _lines * 100 : 1.) << "% orphans ("
+       << _samples << " merges observed)" << endl;
+}
+
+} // namespace cma
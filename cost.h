@@ -0,0 +1,68 @@
+#ifndef __CMA_COST_H
+#define __CMA_COST_H
+
+#include <vector>
+#include <cstdint>
+#include <ostream>
+
+#include <zones.h>
+
+namespace cma {
+
+/**
+ * Estimated work of merging a 4-group: lines already in the topologies of
+ * its zones, whose edges are carried over or reindexed, and orphans to
+ * insert.
+ */
+struct merge_work
+{
+    uint64_t lines = 0;
+    uint64_t orphans = 0;
+};
+
+/**
+ * Linear model of the time a merge takes from its work,
+ *
+ *     seconds = line_rate * lines + orphan_rate * orphans
+ *
+ * fitted by least squares on the merges observed so far. Until the fit is
+ * possible (or when it gives a negative rate) both default rates are scaled
+ * by the measured over predicted time instead.
+ */
+class merge_cost_model
+{
+public:
+    /**
+     * Work of merging the given zones. Orphans come from the line catalog
+     * when it is open, otherwise from the orphan per line ratio observed
+     * so far.
+     */
+    merge_work work(const std::vector<zone*>& children) const;
+
+    double predict(const merge_work& w) const {
+        return _line_rate * w.lines + _orphan_rate * w.orphans;
+    }
+
+    /**
+     * Record the actual orphan count and time of the merge of one group,
+     * timed on its own thread.
+     */
+    void observe(const merge_work& w, uint64_t orphans, double seconds);
+
+    void print(std::ostream& os) const;
+
+private:
+    double _line_rate = 1e-5;           // seconds per line of the merged zones
+    double _orphan_rate = 1e-2;         // seconds per inserted orphan
+
+    // sums of the normal equations
+    double _sll = 0., _slo = 0., _soo = 0., _sls = 0., _sos = 0.;
+    int _samples = 0;
+
+    // observed orphans over lines
+    double _lines = 0., _orphans = 0.;
+};
+
+} // namespace cma
+
+#endif // __CMA_COST_H
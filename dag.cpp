@@ -0,0 +1,584 @@
+#include <dag.h>
+
+#include <map>
+#include <set>
+#include <deque>
+#include <chrono>
+#include <cassert>
+#include <iostream>
+#include <algorithm>
+
+#include <boost/optional.hpp>
+#include <boost/mpi/status.hpp>
+#include <boost/mpi/collectives.hpp>
+#include <boost/mpi/communicator.hpp>
+#include <boost/serialization/map.hpp>
+#include <boost/serialization/vector.hpp>
+#include <boost/serialization/utility.hpp>
+
+#include <cost.h>
+#include <catalog.h>
+#include <merge.h>
+#include <store.h>
+
+using namespace std;
+using namespace boost::mpi;
+
+namespace cma {
+
+const int task_tag = 2;
+const int result_tag = 3;
+
+/**
+ * Groups sent by rank 0 to be merged at once by the merge threads of a
+ * rank (see set_merge_threads()), with their zones 4 by 4. drop lists the
+ * zones merged elsewhere since the last task of the rank, their cached
+ * topologies are outdated.
+ *
+ * In resident mode, ship lists the (zone id, rank) topologies the rank
+ * holds and sends to the ranks merging them, and fetch the (zone id, rank)
+ * topologies of the groups it receives first. A task without groups only
+ * ships topologies and has no result, one without groups nor topologies to
+ * ship stops the rank.
+ */
+struct merge_task
+{
+    vector<int> groups;
+    vector<zone*> zones;
+    vector<int> drop;
+    vector< pair<int, int> > ship;
+    vector< pair<int, int> > fetch;
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int version) {
+        ar & groups;
+        ar & zones;
+        ar & drop;
+        ar & ship;
+        ar & fetch;
+    }
+};
+
+/**
+ * Merged zones of a task sent back to rank 0, in the order of its groups,
+ * with the topologies cached by the merging rank afterwards.
+ */
+struct merge_result
+{
+    vector<int> groups;
+    vector<zone*> merged;
+    int orphans = 0;
+    double seconds = 0.;
+    vector<group_merge_stats> stats;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    map<int, size_t> held;
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int version) {
+        ar & groups;
+        ar & merged;
+        ar & orphans;
+        ar & seconds;
+        ar & stats;
+        ar & hits;
+        ar & misses;
+        ar & held;
+    }
+};
+
+void merge_dependencies(
+    const vector<depth_group_t>& groups,
+    vector< vector<int> >& dependencies)
+{
+    dependencies.assign(groups.size(), vector<int>());
+
+    // group which last produced a zone id
+    map<int, int> producer;
+    for (int i = 0; i < groups.size(); ++i) {
+        for (int zoneId : groups[i].second) {
+            auto it = producer.find(zoneId);
+            if (it != producer.end()) {
+                dependencies[i].push_back(it->second);
+            }
+        }
+        producer[groups[i].second[0]] = i;
+    }
+}
+
+static merge_result run_group(
+    PG& db,
+    GEOSHelper* geos,
+    merge_task& task,
+    bool merge_restore,
+    bool seam_only)
+{
+    vector<int> topologies;
+    for (const zone* z : task.zones) {
+        topologies.push_back(z->id());
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    topology_store& store = topology_store::instance();
+    store.reset_stats();
+
+    merge_result result;
+    result.groups = task.groups;
+    result.orphans = merge_groups(db, geos, task.zones, topologies, result.merged, merge_restore, seam_only, &result.stats);
+    assert (result.merged.size() == task.groups.size());
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+
+    result.hits = store.hits();
+    result.misses = store.misses();
+    result.held = store.holdings();
+
+    // resident topologies only reach the disk through checkpoints
+    static int tasks = 0;
+    int interval = topology_store::checkpoint_interval();
+    if (topology_store::resident() && interval > 0 && ++tasks % interval == 0) {
+        store.checkpoint(geos);
+    }
+
+    return result;
+}
+
+/**
+ * Replace the zones of a group with their merged zone.
+ */
+static void complete_group(
+    vector<zone*>& zones,
+    vector<zone*>& ordered_zones,
+    const depth_group_t& group,
+    zone* merged)
+{
+    vector<zone*> children;
+    for (int zoneId : group.second) {
+        zone* z = get_zone_by_id(zones, zoneId);
+        assert (z);
+        children.push_back(z);
+    }
+
+    // the merged zone takes the place of its first zone
+    ordered_zones.insert(find(begin(ordered_zones), end(ordered_zones), children[0]), merged);
+    zones.push_back(merged);
+
+    for (zone* z : children) {
+        zones.erase(find(begin(zones), end(zones), z));
+        ordered_zones.erase(find(begin(ordered_zones), end(ordered_zones), z));
+        delete z;
+    }
+}
+
+int merge_zones(
+    PG& db,
+    GEOSHelper* geos,
+    vector<zone*>& zones,
+    vector<zone*>& ordered_zones,
+    const vector<depth_group_t>& groups,
+    int first_group,
+    bool merge_restore,
+    bool seam_only)
+{
+    communicator world;
+
+    int orphan_count = 0;
+    bool resident = topology_store::resident();
+    topology_store& store = topology_store::instance();
+
+    // topologies cached (or resident) on each rank, to merge groups where their inputs are
+    vector< map<int, size_t> > held;
+    topology_store::gather_holdings(held);
+
+    if (world.rank() != 0) {
+        while (true) {
+            merge_task task;
+            world.recv(0, task_tag, task);
+            if (task.groups.empty() && task.ship.empty()) {
+                break;
+            }
+
+            for (int zoneId : task.drop) {
+                delete store.take(zoneId);
+            }
+            for (const pair<int, int>& move : task.ship) {
+                store.send(move.first, move.second);
+            }
+            if (task.groups.empty()) {
+                continue;
+            }
+
+            /**
+             * A holder ships the topologies once its current task is done,
+             * which does not wait on topologies told to be shipped later.
+             */
+            for (const pair<int, int>& move : task.fetch) {
+                store.receive(geos, move.second);
+            }
+
+            merge_result result = run_group(db, geos, task, merge_restore, seam_only);
+            world.send(0, result_tag, result);
+
+            delete_all(result.merged);
+            delete_all(task.zones);
+        }
+        store.wait_sends();
+
+        // rank 0 is the sole owner of the zones until the broadcast
+        delete_all(zones);
+        broadcast(world, zones, 0);
+        return orphan_count;
+    }
+
+    int n = groups.size();
+
+    vector< vector<int> > dependencies;
+    merge_dependencies(groups, dependencies);
+
+    vector<int> pending(n);
+    vector< vector<int> > dependents(n);
+    for (int i = 0; i < n; ++i) {
+        pending[i] = dependencies[i].size();
+        for (int j : dependencies[i]) {
+            dependents[j].push_back(i);
+        }
+    }
+
+    vector<bool> done(n, false);
+    int completed = 0;
+    int prefix = 0;     // groups [0, prefix[ are all done
+
+    auto finish = [&](int g) {
+        done[g] = true;
+        ++completed;
+        for (int i : dependents[g]) {
+            --pending[i];
+        }
+        while (prefix < n && done[prefix]) {
+            ++prefix;
+        }
+    };
+
+    vector< set<int> > stale(world.size());               // per rank, zones to drop from its cache
+
+    // already merged groups only need their zone
+    first_group = min(first_group, n);
+    for (int g = 0; g < first_group; ++g) {
+        const depth_group_t& group = groups[g];
+
+        OGREnvelope envelope;
+        int count = 0;
+        for (int i = 0; i < 4; ++i) {
+            zone* z = get_zone_by_id(zones, group.second[i]);
+            assert (z);
+            if (i == 0) {
+                envelope = z->envelope();
+            }
+            else {
+                envelope.Merge(z->envelope());
+            }
+            count += z->count();
+        }
+
+        // the orphans the group inserted belong to the merged zone too
+        uint64_t orphans = 0;
+        if (line_catalog::instance().is_open() && line_catalog::instance().count(envelope, orphans)) {
+            count += orphans;
+        }
+        else {
+            int contained = db.get_line_count(envelope);
+            if (contained >= 0) {
+                count = contained;
+            }
+        }
+
+        zone* merged = new zone(group.second[0], envelope);
+        merged->count(count);
+        complete_group(zones, ordered_zones, group, merged);
+        finish(g);
+
+        // the merged topology is restored from disk, not from the zones left in stores
+        for (int rank = 0; rank < world.size(); ++rank) {
+            stale[rank].insert(begin(group.second), end(group.second));
+            for (int zoneId : group.second) {
+                held[rank].erase(zoneId);
+            }
+        }
+    }
+    if (first_group > 0) {
+        cout << "[" << world.rank() << "] skipping " << first_group << " merge groups" << endl;
+    }
+
+    // ready groups, with their work once the zones they merge exist
+    merge_cost_model model;
+    vector<merge_work> work(n);
+    vector<double> predicted(n, 0.);
+    set<int> ready;
+
+    auto make_ready = [&](int g) {
+        vector<zone*> children;
+        for (int zoneId : groups[g].second) {
+            children.push_back(get_zone_by_id(zones, zoneId));
+        }
+        work[g] = model.work(children);
+        ready.insert(g);
+    };
+
+    // rank holding the resident topology of a zone, -1 if on disk only
+    auto holder = [&](int zoneId) {
+        for (int rank = 0; rank < world.size(); ++rank) {
+            if (held[rank].count(zoneId)) {
+                return rank;
+            }
+        }
+        return -1;
+    };
+
+    // whether rank 0 can merge group g without waiting for topologies of other ranks
+    auto local = [&](int g) {
+        if (!resident) {
+            return true;
+        }
+        for (int zoneId : groups[g].second) {
+            if (holder(zoneId) > 0) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    // longest processing time first, with the rates measured so far, -1 if none qualifies
+    auto next_ready = [&](bool longest, bool local_only) {
+        assert (!ready.empty());
+        auto shorter = [&](int a, int b) {
+            return model.predict(work[a]) < model.predict(work[b]);
+        };
+        auto it = ready.end();
+        for (auto i = ready.begin(); i != ready.end(); ++i) {
+            if (local_only && !local(*i)) {
+                continue;
+            }
+            if (it == ready.end() || (longest ? shorter(*it, *i) : shorter(*i, *it))) {
+                it = i;
+            }
+        }
+        if (it == ready.end()) {
+            return -1;
+        }
+        int g = *it;
+        ready.erase(it);
+        predicted[g] = model.predict(work[g]);
+        return g;
+    };
+
+    // a task of up to threads groups, started with group g
+    int threads = merge_thread_count();
+    auto make_task = [&](merge_task& task, int g, int size, bool longest, bool local_only) {
+        task.groups.push_back(g);
+        while (int(task.groups.size()) < size && !ready.empty()) {
+            int next = next_ready(longest, local_only);
+            if (next < 0) {
+                break;
+            }
+            task.groups.push_back(next);
+        }
+        for (int i : task.groups) {
+            for (int zoneId : groups[i].second) {
+                task.zones.push_back(get_zone_by_id(zones, zoneId));
+            }
+        }
+    };
+
+    for (int g = 0; g < n; ++g) {
+        if (!done[g] && pending[g] == 0) {
+            make_ready(g);
+        }
+    }
+
+    map<int, pair<uint64_t, uint64_t> > cache_stats;     // depth -> hits, fetches
+
+    deque<int> idle;
+    for (int rank = 1; rank < world.size(); ++rank) {
+        idle.push_back(rank);
+    }
+
+    while (completed < n) {
+        merge_result result;
+        int source = 0;
+
+        while (!ready.empty() && !idle.empty()) {
+            int g = next_ready(true, false);
+
+            // idle rank caching most of the group topologies, longest idle first
+            auto best = idle.begin();
+            size_t bestBytes = 0;
+            for (auto it = idle.begin(); it != idle.end(); ++it) {
+                size_t bytes = 0;
+                for (int zoneId : groups[g].second) {
+                    auto h = held[*it].find(zoneId);
+                    bytes += h == held[*it].end() ? 0 : h->second;
+                }
+                if (bytes > bestBytes) {
+                    best = it;
+                    bestBytes = bytes;
+                }
+            }
+            int rank = *best;
+            idle.erase(best);
+
+            // share the ready groups between the idle ranks, the threads of each
+            int size = min<int>(threads, (ready.size() + 1 + idle.size()) / (idle.size() + 1));
+
+            merge_task task;
+            make_task(task, g, size, true, false);
+            task.drop.assign(stale[rank].begin(), stale[rank].end());
+            stale[rank].clear();
+
+            // tell the holders of the resident topologies to ship them to rank
+            map<int, merge_task> ships;
+            for (const zone* z : task.zones) {
+                int from = resident ? holder(z->id()) : -1;
+                if (from < 0 || from == rank) {
+                    continue;
+                }
+                if (from == 0) {
+                    store.send(z->id(), rank);
+                }
+                else {
+                    ships[from].ship.push_back(make_pair(z->id(), rank));
+                }
+                task.fetch.push_back(make_pair(z->id(), from));
+                held[rank][z->id()] = held[from][z->id()];
+                held[from].erase(z->id());
+            }
+            for (const auto& p : ships) {
+                world.send(p.first, task_tag, p.second);
+            }
+            world.send(rank, task_tag, task);
+
+            for (int i : task.groups) {
+                cout << "[" << world.rank() << "] merge group #" << i << " (depth " << groups[i].first
+                     << ", predicted: " << predicted[i] << "s) sent to rank " << rank << " ("
+                     << (bestBytes >> 20) << " MB cached)" << endl;
+            }
+        }
+
+        boost::optional<status> probed;
+        if (world.size() > 1) {
+            probed = world.iprobe(any_source, result_tag);
+        }
+
+        /**
+         * Every other rank is busy: merge groups here rather than wait,
+         * the shortest ones so that finished ranks do not wait long for
+         * their next groups. In resident mode, only groups whose
+         * topologies are not on other ranks.
+         */
+        bool longest = world.size() == 1;
+        int g = !probed && !ready.empty() ? next_ready(longest, true) : -1;
+
+        if (g >= 0) {
+            for (int zoneId : stale[0]) {
+                delete store.take(zoneId);
+            }
+            stale[0].clear();
+
+            merge_task task;
+            make_task(task, g, threads, longest, true);
+            result = run_group(db, geos, task, merge_restore, seam_only);
+        }
+        else {
+            // a dependency free group is always running somewhere
+            assert (idle.size() < world.size() - 1);
+
+            status s = world.recv(any_source, result_tag, result);
+            source = s.source();
+            idle.push_back(source);
+        }
+
+        // the merged zone takes the id of the first zone: others are outdated everywhere else
+        for (int g : result.groups) {
+            for (int rank = 0; rank < world.size(); ++rank) {
+                if (rank != source) {
+                    stale[rank].insert(begin(groups[g].second), end(groups[g].second));
+                }
+            }
+            stale[source].erase(groups[g].second[0]);
+        }
+
+        if (resident) {
+            /**
+             * The topologies shipped by source since it sent its result are
+             * already accounted for: only replace those the groups merged.
+             */
+            for (int g : result.groups) {
+                for (int zoneId : groups[g].second) {
+                    held[source].erase(zoneId);
+                }
+                auto h = result.held.find(groups[g].second[0]);
+                if (h != result.held.end()) {
+                    held[source].insert(*h);
+                }
+            }
+        }
+        else {
+            held[source] = result.held;
+        }
+        for (int rank = 0; rank < world.size(); ++rank) {
+            for (int zoneId : stale[rank]) {
+                held[rank].erase(zoneId);
+            }
+        }
+
+        orphan_count += result.orphans;
+
+        double batch_predicted = 0.;
+        for (int i = 0; i < result.groups.size(); ++i) {
+            int g = result.groups[i];
+            complete_group(zones, ordered_zones, groups[g], result.merged[i]);
+            finish(g);
+
+            for (int j : dependents[g]) {
+                if (pending[j] == 0) {
+                    make_ready(j);
+                }
+            }
+
+            // timed on its own thread, other groups of the task ran alongside
+            model.observe(work[g], result.stats[i].orphans, result.stats[i].seconds);
+            batch_predicted = max(batch_predicted, predicted[g]);
+        }
+
+        int depth = groups[result.groups[0]].first;
+        pair<uint64_t, uint64_t>& depth_stats = cache_stats[depth];
+        depth_stats.first += result.hits;
+        depth_stats.second += result.hits + result.misses;
+
+        cout << "[" << world.rank() << "] merge groups";
+        for (int g : result.groups) {
+            cout << " #" << g;
+        }
+        cout << " done (" << result.orphans
+             << " orphans, " << result.hits << "/" << result.hits + result.misses
+             << " topologies cached, predicted: " << batch_predicted << "s, took: " << result.seconds
+             << "s), " << completed << "/" << n
+             << " groups merged, resume with --merge-step " << prefix << endl;
+        cout << "[" << world.rank() << "] depth " << depth << " cache hit rate: "
+             << 100. * depth_stats.first / max<uint64_t>(depth_stats.second, 1) << "% ("
+             << depth_stats.first << "/" << depth_stats.second << ")" << endl;
+    }
+
+    for (int rank = 1; rank < world.size(); ++rank) {
+        merge_task stop;
+        world.send(rank, task_tag, stop);
+    }
+    store.wait_sends();
+    model.print(cout);
+
+    broadcast(world, zones, 0);
+    return orphan_count;
+}
+
+} // namespace cma
@@ -0,0 +1,55 @@
+#ifndef __CMA_DAG_H
+#define __CMA_DAG_H
+
+#include <vector>
+
+#include <pg.h>
+#include <types.h>
+#include <zones.h>
+
+namespace cma {
+
+/**
+ * Compute the dependencies between merge groups: group i depends on the
+ * groups producing the zones it merges (a merged zone keeps the id of the
+ * first zone of its group). groups must be ordered by depth, deepest
+ * first, which is a valid topological order.
+ */
+void merge_dependencies(
+    const std::vector<depth_group_t>& groups,
+    std::vector< std::vector<int> >& dependencies);
+
+/**
+ * Merge all zones down to a single one, scheduling every 4-group as soon
+ * as the topologies of its 4 zones exist instead of a depth at a time.
+ * A rank is given up to one ready group per merge thread at once (see
+ * set_merge_threads()).
+ *
+ * Rank 0 schedules groups on the idle ranks, the ready group with the
+ * longest predicted merge first (see merge_cost_model) on the idle rank
+ * caching most of its topologies, and merges the shortest ready group
+ * itself whenever the other ranks are all busy.
+ * In resident mode (see topology_store), rank 0 tells the ranks holding
+ * the topologies of a group to ship them to its merging rank, and only
+ * merges groups itself whose topologies are not on other ranks.
+ *
+ * It is the sole owner of zones, ordered_zones and groups,
+ * which are updated as groups complete. The first first_group groups (in
+ * depth order) are considered already merged so that a run can be resumed
+ * from the completed group count it logs.
+ *
+ * This is a collective operation. Returns the total orphan count on rank 0.
+ */
+int merge_zones(
+    PG& db,
+    GEOSHelper* geos,
+    std::vector<zone*>& zones,
+    std::vector<zone*>& ordered_zones,
+    const std::vector<depth_group_t>& groups,
+    int first_group = 0,
+    bool merge_restore = true,
+    bool seam_only = false);
+
+} // namespace cma
+
+#endif // __CMA_DAG_H
@@ -0,0 +1,112 @@
+#include <facecache.h>
+
+#include <cassert>
+#include <iostream>
+
+#include <utils.h>
+
+using namespace std;
+
+namespace cma {
+
+size_t face_geometry_cache::s_default_capacity = size_t(256) << 20;
+
+/**
+ * Rough memory used by a GEOS geometry: 3D coordinates plus
+ * some overhead per component.
+ */
+size_t _geometry_bytes(const GEOSGeometry* geom)
+{
+    size_t coords = GEOSGetNumCoordinates_r(hdl, geom);
+    size_t parts = GEOSGetNumGeometries_r(hdl, geom);
+    return coords * 3 * sizeof(double) + (parts + 1) * 128;
+}
+
+face_geometry_cache::face_geometry_cache()
+: _capacity(s_default_capacity)
+{
+}
+
+face_geometry_cache::~face_geometry_cache()
+{
+    clear();
+}
+
+void face_geometry_cache::default_capacity(size_t bytes)
+{
+    s_default_capacity = bytes;
+}
+
+GEOSGeometry* face_geometry_cache::get(int faceId)
+{
+    auto it = _entries.find(faceId);
+    if (it == _entries.end()) {
+        ++_misses;
+        return nullptr;
+    }
+
+    ++_hits;
+    _lru.splice(_lru.begin(), _lru, it->second.lru);
+    return it->second.geom;
+}
+
+void face_geometry_cache::put(int faceId, GEOSGeometry* geom)
+{
+    invalidate(faceId);
+
+    if (!geom) {
+        return;
+    }
+
+    _entry_t entry;
+    entry.geom = geom;
+    entry.bytes = _geometry_bytes(geom);
+    _lru.push_front(faceId);
+    entry.lru = _lru.begin();
+
+    _entries[faceId] = entry;
+    _bytes += entry.bytes;
+
+    // the new geometry is kept even if it exceeds the capacity by itself
+    while (_bytes > _capacity && _lru.size() > 1) {
+        _erase(_entries.find(_lru.back()));
+        ++_evictions;
+    }
+}
+
+void face_geometry_cache::invalidate(int faceId)
+{
+    auto it = _entries.find(faceId);
+    if (it != _entries.end()) {
+        _erase(it);
+    }
+}
+
+void face_geometry_cache::clear()
+{
+    for (auto& p : _entries) {
+        GEOSGeom_destroy_r(hdl, p.second.geom);
+    }
+    _entries.clear();
+    _lru.clear();
+    _bytes = 0;
+}
+
+void face_geometry_cache::print_stats(ostream& os) const
+{
+    os << "  face cache -- hits: " << _hits << " misses: " << _misses
+       << " evictions: " << _evictions << " size: " << _entries.size()
+       << " (" << (_bytes >> 10) << " KB)" << endl;
+}
+
+void face_geometry_cache::_erase(unordered_map<int, _entry_t>::iterator it)
+{
+    assert (it != _entries.end());
+
+    GEOSGeom_destroy_r(hdl, it->second.geom);
+    _bytes -= it->second.bytes;
+    _lru.erase(it->second.lru);
+    _entries.erase(it);
+}
+
+} // namespace cma
@@ -0,0 +1,96 @@
+#ifndef __CMA_FACECACHE_H
+#define __CMA_FACECACHE_H
+
+#include <list>
+#include <cstdint>
+#include <ostream>
+#include <geos_c.h>
+#include <unordered_map>
+
+namespace cma {
+
+/**
+ * Rough memory used by a GEOS geometry.
+ */
+size_t _geometry_bytes(const GEOSGeometry* geom);
+
+/**
+ * Least recently used cache of face geometries (see ST_GetFaceGeometry()).
+ *
+ * Geometries are owned by the cache. The memory they use is estimated from
+ * their coordinate count and the least recently used ones are destroyed
+ * once the capacity is exceeded, so a geometry returned by get() is only
+ * valid until the next put().
+ */
+class face_geometry_cache
+{
+public:
+    face_geometry_cache();
+    ~face_geometry_cache();
+
+    face_geometry_cache(const face_geometry_cache&) = delete;
+    face_geometry_cache& operator=(const face_geometry_cache&) = delete;
+
+    /**
+     * Capacity in bytes of the caches created afterwards (default: 256MB).
+     */
+    static void default_capacity(size_t bytes);
+
+    /**
+     * Return the cached geometry of a face or nullptr.
+     */
+    GEOSGeometry* get(int faceId);
+
+    /**
+     * Cache the geometry of a face, taking ownership of it.
+     */
+    void put(int faceId, GEOSGeometry* geom);
+
+    /**
+     * Forget the geometry of a face, its ring changed.
+     */
+    void invalidate(int faceId);
+
+    void clear();
+
+    uint64_t hits() const {
+        return _hits;
+    }
+    uint64_t misses() const {
+        return _misses;
+    }
+    uint64_t evictions() const {
+        return _evictions;
+    }
+    size_t bytes() const {
+        return _bytes;
+    }
+
+    void print_stats(std::ostream& os) const;
+
+private:
+    class _entry_t {
+      public:
+        GEOSGeometry* geom;
+        size_t bytes;
+        std::list<int>::iterator lru;
+    };
+
+    static size_t s_default_capacity;
+
+    size_t _capacity;
+    size_t _bytes = 0;
+
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+    uint64_t _evictions = 0;
+
+    std::list<int> _lru;    // most recently used first
+    std::unordered_map<int, _entry_t> _entries;
+
+    void _erase(std::unordered_map<int, _entry_t>::iterator it);
+};
+
+} // namespace cma
+
+#endif // __CMA_FACECACHE_H
@@ -0,0 +1,455 @@
+#include <topology.h>
+
+#include <cmath>
+#include <cassert>
+#include <numeric>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+
+#include <st.h>
+#include <fixed.h>
+
+using namespace std;
+
+namespace bgi = boost::geometry::index;
+
+namespace cma {
+
+/**
+ * Bulk face construction (deferred face mode).
+ *
+ * Every directed edge (+id for its left side, -id for its right side)
+ * belongs to exactly one ring, obtained by following next_left_edge/
+ * next_right_edge. Rings turning counter-clockwise bound a new face while
+ * the other ones (one per connected component) are the outer boundary of
+ * their component and belong to the smallest face of another component
+ * containing them, or to the universal face.
+ */
+
+typedef __int128 int128_t;
+
+/**
+ * A ring of directed edges.
+ */
+class _ring_t {
+  public:
+    std::vector<int> edges;
+    std::vector<int> single;    // directed edges not traversed both ways
+    double area = 0.;           // twice the signed area
+    box mbr;
+    int component = -1;
+    int face = 0;
+};
+
+/**
+ * Per edge data computed once for all rings.
+ */
+class _edge_data_t {
+  public:
+    std::vector<double> xs;
+    std::vector<double> ys;
+    double area = 0.;           // shoelace sum of its segments (relative to origin)
+    int128_t grid_area = 0;     // same in grid units (fixed grid mode)
+    box mbr;
+};
+
+int _find_component(vector<int>& parents, int i)
+{
+    while (parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
+
+/**
+ * Crossing number test of (x, y) against the segments of the given edges.
+ * Edges traversed both ways cross an even number of times and are thus skipped.
+ */
+bool _ring_contains(const vector<_edge_data_t>& data, const _ring_t& ring, double x, double y)
+{
+    bool inside = false;
+    for (int edgeId : ring.single) {
+        const _edge_data_t& d = data[abs(edgeId)];
+        for (size_t i = 0; i + 1 < d.xs.size(); ++i) {
+            double x1 = d.xs[i], y1 = d.ys[i];
+            double x2 = d.xs[i+1], y2 = d.ys[i+1];
+            if ((y1 > y) != (y2 > y)) {
+                double xc = x1 + (y - y1) * (x2 - x1) / (y2 - y1);
+                if (x < xc) {
+                    inside = !inside;
+                }
+            }
+        }
+    }
+    return inside;
+}
+
+/**
+ * Polygon with the same point order as ST_Envelope().
+ */
+GEOSGeometry* _mbr_polygon(const box& b)
+{
+    double xs[] = { b.min_corner().x(), b.min_corner().x(), b.max_corner().x(), b.max_corner().x(), b.min_corner().x() };
+    double ys[] = { b.min_corner().y(), b.max_corner().y(), b.max_corner().y(), b.min_corner().y(), b.min_corner().y() };
+
+    GEOSCoordSequence* seq = GEOSCoordSeq_create_r(hdl, 5, 2);
+    for (int i = 0; i < 5; ++i) {
+        GEOSCoordSeq_setX_r(hdl, seq, i, xs[i]);
+        GEOSCoordSeq_setY_r(hdl, seq, i, ys[i]);
+    }
+
+    GEOSGeometry* shell = GEOSGeom_createLinearRing_r(hdl, seq);
+    return GEOSGeom_createPolygon_r(hdl, shell, NULL, 0);
+}
+
+void Topology::_drop_faces()
+{
+    assert (_transactions->empty());
+
+    _stale_faces = true;
+
+    if (_faces.empty()) {
+        return;
+    }
+
+    // note: only lines are added to our topologies so there are no face relations
+    for (size_t i = 1; i < _faces.size(); ++i) {
+        delete _faces[i];
+    }
+    _faces.resize(1);
+
+    _face_geometries->clear();
+
+    _left_faces_idx->clear();
+    _right_faces_idx->clear();
+    _left_faces_idx->push_back(edgeid_set_ptr(new edgeid_set));
+    _right_faces_idx->push_back(edgeid_set_ptr(new edgeid_set));
+
+    for (edge* e : _edges) {
+        if (!e) continue;
+        e->left_face = 0;
+        e->right_face = 0;
+        _store_links(e);
+        (*_left_faces_idx)[0]->insert(e->id);
+        (*_right_faces_idx)[0]->insert(e->id);
+    }
+
+    for (node* n : _nodes) {
+        if (n && !_is_null(n->containing_face)) {
+            n->containing_face = 0;
+        }
+    }
+}
+
+void Topology::build_faces()
+{
+    if (!_stale_faces || _faces.empty()) {
+        return;
+    }
+
+    _drop_faces();
+    _stale_faces = false;
+
+    int edgeCount = _edges.size();
+    int nodeCount = _nodes.size();
+
+    // links are only read from here on
+    const edge_table& links = _links;
+
+    // 1. Connected components (union-find on nodes). Rings of different
+    //    components are independent and walked concurrently.
+    vector<int> parents(nodeCount);
+    iota(parents.begin(), parents.end(), 0);
+    vector<bool> has_edges(nodeCount, false);
+    for (int edgeId = 1; edgeId < edgeCount; ++edgeId) {
+        if (!links.exists(edgeId)) continue;
+        int start_node = links.start_node[edgeId];
+        int end_node = links.end_node[edgeId];
+        has_edges[start_node] = has_edges[end_node] = true;
+        int a = _find_component(parents, start_node);
+        int b = _find_component(parents, end_node);
+        if (a != b) {
+            parents[max(a, b)] = min(a, b);
+        }
+    }
+
+    // edges of every component, by increasing id
+    vector<int> component_idx(nodeCount, -1);
+    vector< vector<int> > component_edges;
+    vector<int> edge_component(edgeCount, -1);
+    for (int edgeId = 1; edgeId < edgeCount; ++edgeId) {
+        if (!links.exists(edgeId)) continue;
+        int root = _find_component(parents, links.start_node[edgeId]);
+        if (component_idx[root] < 0) {
+            component_idx[root] = component_edges.size();
+            component_edges.push_back(vector<int>());
+        }
+        edge_component[edgeId] = component_idx[root];
+        component_edges[component_idx[root]].push_back(edgeId);
+    }
+    int componentCount = component_edges.size();
+
+    // origin of shoelace sums, limits rounding errors
+    double ox = 0., oy = 0.;
+    for (const node* n : _nodes) {
+        if (!n) continue;
+        GEOSGeomGetX_r(hdl, n->geom, &ox);
+        GEOSGeomGetY_r(hdl, n->geom, &oy);
+        break;
+    }
+
+    vector<_edge_data_t> data(edgeCount);
+    vector<int> left_ring(edgeCount, -1);
+    vector<int> right_ring(edgeCount, -1);
+    vector< vector<_ring_t> > component_rings(componentCount);
+    const char* error = nullptr;
+
+    #pragma omp parallel
+    {
+        // each thread needs its own GEOS context
+        thread_geos();
+
+        // 2. Edge coordinates, MBR and shoelace sum (exact on a fixed grid)
+        #pragma omp for schedule(dynamic, 256)
+        for (int edgeId = 1; edgeId < edgeCount; ++edgeId) {
+            const edge* e = _edges[edgeId];
+            if (!e) continue;
+
+            _edge_data_t& d = data[edgeId];
+
+            const GEOSCoordSequence* seq = GEOSGeom_getCoordSeq_r(hdl, e->geom);
+            unsigned int size;
+            GEOSCoordSeq_getSize_r(hdl, seq, &size);
+
+            d.xs.resize(size);
+            d.ys.resize(size);
+            for (unsigned int i = 0; i < size; ++i) {
+                GEOSCoordSeq_getX_r(hdl, seq, i, &d.xs[i]);
+                GEOSCoordSeq_getY_r(hdl, seq, i, &d.ys[i]);
+            }
+
+            if (fixed_grid()) {
+                vector<grid_point> points;
+                grid_points(e->geom, points);
+                for (size_t i = 0; i + 1 < points.size(); ++i) {
+                    d.grid_area += int128_t(points[i].first) * points[i+1].second
+                                 - int128_t(points[i+1].first) * points[i].second;
+                }
+            }
+            else {
+                for (size_t i = 0; i + 1 < size; ++i) {
+                    d.area += (d.xs[i] - ox) * (d.ys[i+1] - oy) - (d.xs[i+1] - ox) * (d.ys[i] - oy);
+                }
+            }
+
+            auto xr = minmax_element(d.xs.begin(), d.xs.end());
+            auto yr = minmax_element(d.ys.begin(), d.ys.end());
+            d.mbr = box(point(*xr.first, *yr.first), point(*xr.second, *yr.second));
+        }
+
+        // 3. Walk rings of every component, each directed edge is visited
+        //    once. Ring indexes are local to their component for now.
+        #pragma omp for schedule(dynamic, 1)
+        for (int c = 0; c < componentCount; ++c) {
+            vector<_ring_t>& rings = component_rings[c];
+
+            for (int edgeId : component_edges[c]) {
+                for (int start : { edgeId, -edgeId }) {
+                    if ((start > 0 ? left_ring[edgeId] : right_ring[edgeId]) >= 0) {
+                        continue;
+                    }
+
+                    int ringIdx = rings.size();
+                    rings.push_back(_ring_t());
+                    _ring_t& ring = rings.back();
+                    ring.component = c;
+
+                    int cur = start;
+                    do {
+                        if (abs(cur) >= edgeCount || edge_component[abs(cur)] != c) {
+                            #pragma omp critical
+                            error = "build_faces: dangling edge link";
+                            break;
+                        }
+
+                        int& visited = cur > 0 ? left_ring[cur] : right_ring[-cur];
+                        if (visited >= 0) {
+                            #pragma omp critical
+                            error = "build_faces: inconsistent edge links";
+                            break;
+                        }
+                        visited = ringIdx;
+                        ring.edges.push_back(cur);
+
+                        cur = links.next(cur);
+                    } while (cur != start);
+                }
+            }
+
+            // 4. Rings area (edges traversed both ways cancel out) and MBR
+            for (_ring_t& ring : rings) {
+                int128_t grid_area = 0;
+
+                ring.mbr = data[abs(ring.edges[0])].mbr;
+                for (int edgeId : ring.edges) {
+                    int eid = abs(edgeId);
+                    boost::geometry::expand(ring.mbr, data[eid].mbr);
+
+                    if (left_ring[eid] != right_ring[eid]) {
+                        ring.single.push_back(edgeId);
+                        ring.area += edgeId > 0 ? data[eid].area : -data[eid].area;
+                        grid_area += edgeId > 0 ? data[eid].grid_area : -data[eid].grid_area;
+                    }
+                }
+
+                if (fixed_grid()) {
+                    // exact sign, the magnitude is only used for comparisons
+                    ring.area = double(grid_area);
+                }
+            }
+        }
+    }
+
+    if (error) {
+        throw runtime_error(error);
+    }
+
+    // 5. Rings in the order a serial walk over edge ids would find them,
+    //    i.e. by their first directed edge (+id before -id), so that face
+    //    ids do not depend on the thread count.
+    auto ring_key = [](const _ring_t& ring) {
+        int start = ring.edges[0];
+        return 2 * abs(start) + (start < 0 ? 1 : 0);
+    };
+
+    vector<int> ring_offsets(componentCount + 1, 0);
+    for (int c = 0; c < componentCount; ++c) {
+        ring_offsets[c+1] = ring_offsets[c] + component_rings[c].size();
+    }
+
+    vector<_ring_t> rings;
+    rings.reserve(ring_offsets[componentCount]);
+    for (vector<_ring_t>& component : component_rings) {
+        move(component.begin(), component.end(), back_inserter(rings));
+    }
+    component_rings.clear();
+
+    vector<int> order(rings.size());
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&rings, &ring_key](int a, int b) {
+        return ring_key(rings[a]) < ring_key(rings[b]);
+    });
+
+    // counter-clockwise rings are faces, numbered in that order
+    vector<int> ring_faces(rings.size(), 0);
+    for (int ringIdx : order) {
+        if (rings[ringIdx].area <= 0.) continue;
+
+        face* f = new face;
+        f->id = _faces.size();
+        _faces.push_back(f);
+
+        _left_faces_idx->push_back(edgeid_set_ptr(new edgeid_set));
+        _right_faces_idx->push_back(edgeid_set_ptr(new edgeid_set));
+
+        ring_faces[ringIdx] = f->id;
+    }
+    for (int i = 0; i < rings.size(); ++i) {
+        rings[i].face = ring_faces[i];
+    }
+
+    typedef pair<box, int> ring_value;
+    vector<ring_value> face_values;
+    for (int i = 0; i < rings.size(); ++i) {
+        if (rings[i].face > 0) {
+            face_values.push_back(make_pair(rings[i].mbr, i));
+        }
+    }
+    bgi::rtree< ring_value, bgi::rstar<16> > face_idx(face_values.begin(), face_values.end());
+
+    // the smallest face of another component containing (x, y)
+    auto containing_face = [&](double x, double y, int component) {
+        vector<ring_value> candidates;
+        face_idx.query(bgi::intersects(point(x, y)), back_inserter(candidates));
+
+        int faceId = 0;
+        double area = numeric_limits<double>::max();
+        for (const ring_value& v : candidates) {
+            const _ring_t& r = rings[v.second];
+            if (r.component == component || r.area >= area) continue;
+            if (_ring_contains(data, r, x, y)) {
+                faceId = r.face;
+                area = r.area;
+            }
+        }
+        return faceId;
+    };
+
+    int ringCount = rings.size();
+
+    #pragma omp parallel
+    {
+        thread_geos();
+
+        // 6. Face MBR
+        #pragma omp for schedule(dynamic, 256)
+        for (int i = 0; i < ringCount; ++i) {
+            if (rings[i].face > 0) {
+                _faces[rings[i].face]->set_geom(_mbr_polygon(rings[i].mbr));
+            }
+        }
+
+        // 7. Containing face of outer rings and isolated nodes. Only
+        //    outer rings are updated, face rings are left untouched.
+        #pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < ringCount; ++i) {
+            _ring_t& ring = rings[i];
+            if (ring_faces[i] > 0) continue;
+
+            const _edge_data_t& d = data[abs(ring.edges[0])];
+            ring.face = containing_face(d.xs[0], d.ys[0], ring.component);
+        }
+
+        #pragma omp for schedule(dynamic, 256)
+        for (int nodeId = 1; nodeId < nodeCount; ++nodeId) {
+            node* n = _nodes[nodeId];
+            if (!n) continue;
+
+            if (has_edges[nodeId]) {
+                n->containing_face = NULLint;
+            }
+            else {
+                double x, y;
+                GEOSGeomGetX_r(hdl, n->geom, &x);
+                GEOSGeomGetY_r(hdl, n->geom, &y);
+                n->containing_face = containing_face(x, y, -1);
+            }
+        }
+
+        // 8. Label edges
+        #pragma omp for schedule(static)
+        for (int edgeId = 1; edgeId < edgeCount; ++edgeId) {
+            edge* e = _edges[edgeId];
+            if (!e) continue;
+
+            int c = edge_component[edgeId];
+            e->left_face = rings[ring_offsets[c] + left_ring[edgeId]].face;
+            e->right_face = rings[ring_offsets[c] + right_ring[edgeId]].face;
+            _links.left_face[edgeId] = e->left_face;
+            _links.right_face[edgeId] = e->right_face;
+        }
+    }
+
+    // face edge index (not thread safe)
+    (*_left_faces_idx)[0]->clear();
+    (*_right_faces_idx)[0]->clear();
+    for (const edge* e : _edges) {
+        if (!e) continue;
+        (*_left_faces_idx)[e->left_face]->insert(e->id);
+        (*_right_faces_idx)[e->right_face]->insert(e->id);
+    }
+}
+
+} // namespace cma
@@ -0,0 +1,342 @@
+#include <fixed.h>
+
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <stdexcept>
+
+#include <utils.h>
+
+using namespace std;
+
+namespace cma {
+
+typedef __int128 int128_t;
+
+static double _grid_size = 0.;
+
+void set_grid_size(double size)
+{
+    if (size < 0.) {
+        throw invalid_argument("grid size must be positive.");
+    }
+    _grid_size = size;
+}
+
+double grid_size()
+{
+    return _grid_size;
+}
+
+bool fixed_grid()
+{
+    return _grid_size > 0.;
+}
+
+int64_t _to_grid(double v)
+{
+    return llround(v / _grid_size);
+}
+
+double _from_grid(int64_t v)
+{
+    return v * _grid_size;
+}
+
+/**
+ * Snap a linestring, returns nullptr if it collapsed to a single point.
+ */
+GEOSGeometry* _snap_line(const GEOSGeometry* line)
+{
+    vector<grid_point> points;
+    grid_points(line, points);
+    points.erase(unique(points.begin(), points.end()), points.end());
+
+    if (points.size() < 2) {
+        return nullptr;
+    }
+
+    GEOSCoordSequence* seq = GEOSCoordSeq_create_r(hdl, points.size(), 2);
+    for (int i = 0; i < points.size(); ++i) {
+        GEOSCoordSeq_setX_r(hdl, seq, i, _from_grid(points[i].first));
+        GEOSCoordSeq_setY_r(hdl, seq, i, _from_grid(points[i].second));
+    }
+
+    return GEOSGeom_createLineString_r(hdl, seq);
+}
+
+GEOSGeometry* snap_to_grid(const GEOSGeometry* geom)
+{
+    assert (fixed_grid());
+    assert (geom);
+
+    GEOSGeometry* snapped = nullptr;
+
+    switch (GEOSGeomTypeId_r(hdl, geom))
+    {
+    case GEOS_POINT: {
+        if (GEOSisEmpty_r(hdl, geom) == 1) {
+            snapped = GEOSGeom_clone_r(hdl, geom);
+            break;
+        }
+
+        double x, y;
+        GEOSGeomGetX_r(hdl, geom, &x);
+        GEOSGeomGetY_r(hdl, geom, &y);
+
+        GEOSCoordSequence* seq = GEOSCoordSeq_create_r(hdl, 1, 2);
+        GEOSCoordSeq_setX_r(hdl, seq, 0, _from_grid(_to_grid(x)));
+        GEOSCoordSeq_setY_r(hdl, seq, 0, _from_grid(_to_grid(y)));
+        snapped = GEOSGeom_createPoint_r(hdl, seq);
+        break;
+    }
+    case GEOS_LINESTRING: {
+        snapped = _snap_line(geom);
+        if (!snapped) {
+            snapped = GEOSGeom_createEmptyLineString_r(hdl);
+        }
+        break;
+    }
+    case GEOS_MULTIPOINT:
+    case GEOS_MULTILINESTRING:
+    case GEOS_GEOMETRYCOLLECTION: {
+        vector<GEOSGeometry*> parts;
+        int type = GEOS_MULTILINESTRING;
+        for (int i = 0; i < GEOSGetNumGeometries_r(hdl, geom); ++i) {
+            const GEOSGeometry* g = GEOSGetGeometryN_r(hdl, geom, i);
+            GEOSGeometry* part;
+            if (GEOSGeomTypeId_r(hdl, g) == GEOS_POINT) {
+                type = GEOS_MULTIPOINT;
+                part = snap_to_grid(g);
+            }
+            else if (GEOSGeomTypeId_r(hdl, g) == GEOS_LINESTRING) {
+                part = _snap_line(g);
+            }
+            else {
+                for (GEOSGeometry* part : parts) {
+                    GEOSGeom_destroy_r(hdl, part);
+                }
+                throw invalid_argument("unsupported geometry type.");
+            }
+
+            if (part) {
+                parts.push_back(part);
+            }
+        }
+        snapped = GEOSGeom_createCollection_r(hdl, type, parts.data(), parts.size());
+        break;
+    }
+    default:
+        throw invalid_argument("unsupported geometry type.");
+    };
+
+    GEOSSetSRID_r(hdl, snapped, GEOSGetSRID_r(hdl, geom));
+    return snapped;
+}
+
+/**
+ * Rounds of union and snap before giving up on a stable noding.
+ */
+const int max_noding_rounds = 8;
+
+GEOSGeometry* node_on_grid(const GEOSGeometry* geom)
+{
+    assert (fixed_grid());
+    assert (geom);
+
+#if GEOS_VERSION_MAJOR > 3 || (GEOS_VERSION_MAJOR == 3 && GEOS_VERSION_MINOR >= 9)
+    return GEOSUnaryUnionPrec_r(hdl, geom, _grid_size);
+#else
+    GEOSGeometry* noded = GEOSUnaryUnion_r(hdl, geom);
+    for (int round = 0; noded && round < max_noding_rounds; ++round) {
+        GEOSGeometry* snapped = snap_to_grid(noded);
+        GEOSGeom_destroy_r(hdl, noded);
+
+        // rounding created no new intersection if noding again changes nothing
+        noded = GEOSUnaryUnion_r(hdl, snapped);
+        if (!noded) {
+            GEOSGeom_destroy_r(hdl, snapped);
+            return nullptr;
+        }
+
+        GEOSGeometry* a = GEOSGeom_clone_r(hdl, snapped);
+        GEOSNormalize_r(hdl, a);
+        GEOSNormalize_r(hdl, noded);
+        bool stable = GEOSEqualsExact_r(hdl, a, noded, 0.) == 1;
+        GEOSGeom_destroy_r(hdl, a);
+
+        if (stable) {
+            GEOSGeom_destroy_r(hdl, noded);
+            return snapped;
+        }
+        GEOSGeom_destroy_r(hdl, snapped);
+    }
+
+    // not stable, the last rounding may still leave crossings
+    if (noded) {
+        GEOSGeometry* snapped = snap_to_grid(noded);
+        GEOSGeom_destroy_r(hdl, noded);
+        noded = snapped;
+    }
+    return noded;
+#endif
+}
+
+void grid_points(const GEOSGeometry* geom, vector<grid_point>& points)
+{
+    assert (fixed_grid());
+    assert (points.empty());
+
+    const GEOSCoordSequence* seq = GEOSGeom_getCoordSeq_r(hdl, geom);
+    unsigned int size;
+    GEOSCoordSeq_getSize_r(hdl, seq, &size);
+
+    points.reserve(size);
+
+    double x, y;
+    for (unsigned int i = 0; i < size; ++i) {
+        GEOSCoordSeq_getX_r(hdl, seq, i, &x);
+        GEOSCoordSeq_getY_r(hdl, seq, i, &y);
+        points.push_back(grid_point(_to_grid(x), _to_grid(y)));
+    }
+}
+
+int orientation(const grid_point& a, const grid_point& b, const grid_point& c)
+{
+    int128_t det =
+        int128_t(b.first - a.first) * (c.second - a.second) -
+        int128_t(b.second - a.second) * (c.first - a.first);
+    return (det > 0) - (det < 0);
+}
+
+/**
+ * Whether p, known to be collinear with [a, b], lies on it.
+ */
+bool _on_segment(const grid_point& a, const grid_point& b, const grid_point& p)
+{
+    return min(a.first, b.first) <= p.first && p.first <= max(a.first, b.first)
+        && min(a.second, b.second) <= p.second && p.second <= max(a.second, b.second);
+}
+
+bool segments_intersect(
+    const grid_point& a,
+    const grid_point& b,
+    const grid_point& c,
+    const grid_point& d)
+{
+    int o1 = orientation(a, b, c);
+    int o2 = orientation(a, b, d);
+    int o3 = orientation(c, d, a);
+    int o4 = orientation(c, d, b);
+
+    if (o1 != o2 && o3 != o4) {
+        return true;
+    }
+
+    return (o1 == 0 && _on_segment(a, b, c))
+        || (o2 == 0 && _on_segment(a, b, d))
+        || (o3 == 0 && _on_segment(c, d, a))
+        || (o4 == 0 && _on_segment(c, d, b));
+}
+
+/**
+ * Whether [p, a] and [p, c], sharing p, overlap beyond it.
+ */
+bool _overlap_at(const grid_point& p, const grid_point& a, const grid_point& c)
+{
+    if (orientation(p, a, c) != 0) {
+        return false;
+    }
+
+    int128_t dot =
+        int128_t(a.first - p.first) * (c.first - p.first) +
+        int128_t(a.second - p.second) * (c.second - p.second);
+    return dot > 0;
+}
+
+bool is_simple(const GEOSGeometry* line)
+{
+    assert (GEOSGeomTypeId_r(hdl, line) == GEOS_LINESTRING);
+
+    vector<grid_point> points;
+    grid_points(line, points);
+    points.erase(unique(points.begin(), points.end()), points.end());
+
+    if (points.size() < 3) {
+        return true;
+    }
+
+    int n = points.size() - 1;      // segment count
+    bool closed = points.front() == points.back();
+
+    // sweep segments along x, only segments overlapping in x are compared
+    vector<int> order(n);
+    for (int i = 0; i < n; ++i) {
+        order[i] = i;
+    }
+    auto minx = [&points](int s) {
+        return min(points[s].first, points[s+1].first);
+    };
+    auto maxx = [&points](int s) {
+        return max(points[s].first, points[s+1].first);
+    };
+    sort(order.begin(), order.end(), [&minx](int a, int b) {
+        return minx(a) < minx(b);
+    });
+
+    vector<int> active;
+    for (int i : order) {
+        int64_t x = minx(i);
+        active.erase(
+            remove_if(active.begin(), active.end(), [&maxx, x](int s) {
+                return maxx(s) < x;
+            }),
+            active.end()
+        );
+
+        for (int j : active) {
+            int lo = min(i, j);
+            int hi = max(i, j);
+
+            if (hi == lo + 1) {
+                // consecutive segments share points[hi]
+                if (_overlap_at(points[hi], points[lo], points[hi+1])) {
+                    return false;
+                }
+            }
+            else if (closed && lo == 0 && hi == n-1) {
+                // first and last segments of a ring share points[0]
+                if (_overlap_at(points[0], points[1], points[n-1])) {
+                    return false;
+                }
+            }
+            else if (segments_intersect(points[lo], points[lo+1], points[hi], points[hi+1])) {
+                return false;
+            }
+        }
+        active.push_back(i);
+    }
+
+    return true;
+}
+
+bool is_ccw(const GEOSGeometry* geom)
+{
+    if (GEOSGeomTypeId_r(hdl, geom) == GEOS_POLYGON) {
+        geom = GEOSGetExteriorRing_r(hdl, geom);
+    }
+
+    vector<grid_point> points;
+    grid_points(geom, points);
+
+    // twice the signed area (shoelace formula)
+    int128_t area = 0;
+    for (int i = 0; i + 1 < points.size(); ++i) {
+        area += int128_t(points[i].first) * points[i+1].second
+              - int128_t(points[i+1].first) * points[i].second;
+    }
+
+    return area >= 0;
+}
+
+} // namespace cma
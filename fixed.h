@@ -0,0 +1,79 @@
+#ifndef __CMA_FIXED_H
+#define __CMA_FIXED_H
+
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <geos_c.h>
+
+namespace cma {
+
+/**
+ * Fixed grid coordinate mode.
+ *
+ * When a grid size is set (e.g. 1e-6 for 1 micrometer), ingested coordinates
+ * are snapped to multiples of it. Coordinates can then be handled as int64
+ * grid units so that orientation, intersection and simplicity tests are
+ * computed exactly (products are done on 128 bits).
+ */
+typedef std::pair<int64_t, int64_t> grid_point;
+
+/**
+ * Set the grid size in meters (0 disables the fixed grid mode).
+ * It must be set once, before any topology is built.
+ */
+void set_grid_size(double size);
+double grid_size();
+
+bool fixed_grid();
+
+/**
+ * Return a copy of a (multi)point or (multi)linestring with its coordinates
+ * snapped to the grid. Repeated points are removed and collapsed linestrings
+ * are dropped. The resulting geometry must be freed by the caller.
+ */
+GEOSGeometry* snap_to_grid(const GEOSGeometry* geom);
+
+/**
+ * Node (multi)linestrings on the grid: like GEOSUnaryUnion_r() followed by
+ * snap_to_grid(), except that crossings and overlaps created by rounding
+ * the intersection points are noded again until the result is stable
+ * (snap-rounding). Returns nullptr if noding fails. The resulting geometry
+ * must be freed by the caller.
+ */
+GEOSGeometry* node_on_grid(const GEOSGeometry* geom);
+
+/**
+ * Get the grid coordinates of a point, linestring or linear ring.
+ */
+void grid_points(const GEOSGeometry* geom, std::vector<grid_point>& points);
+
+/**
+ * Sign of the (b - a) x (c - a) cross product: 1 if a, b, c turn
+ * counter-clockwise, -1 if clockwise, 0 if they are collinear.
+ */
+int orientation(const grid_point& a, const grid_point& b, const grid_point& c);
+
+/**
+ * Whether segments [a, b] and [c, d] have at least one point in common.
+ */
+bool segments_intersect(
+    const grid_point& a,
+    const grid_point& b,
+    const grid_point& c,
+    const grid_point& d);
+
+/**
+ * Exact GEOSisSimple() for a linestring on the grid.
+ */
+bool is_simple(const GEOSGeometry* line);
+
+/**
+ * Exact orientation of a polygon shell (or closed linestring) on the grid.
+ * Zero area rings are deemed counter-clockwise, as liblwgeom does.
+ */
+bool is_ccw(const GEOSGeometry* geom);
+
+} // namespace cma
+
+#endif // __CMA_FIXED_H
@@ -9,10 +9,6 @@
 using namespace cma;
 using namespace std;
 
-namespace cma {
-    GEOSContextHandle_t hdl;
-}
-
 void callback(void *item, void *userdata)
 {
     GEOSGeometry* geom_contaning = (GEOSGeometry*)item;
@@ -31,7 +27,7 @@ void callback(void *item, void *userdata)
 
 int main(int /*argc*/, char** /*argv*/)
 {
-    GEOSHelper geos = GEOSHelper();
+    GEOSHelper geos;
     assert (hdl != NULL);
 
     GEOSWKTReader* wktr = geos.text_reader();
@@ -0,0 +1,166 @@
+// icpc -g -openmp -O3 -std=c++11 -I.. `gdal-config --cflags` lineorder.cpp ../build.o ../merge.o ../pg.o ../st.o ../topology.o ../transaction.o ../types.o ../utils.o ../zones.o -o lineorder `gdal-config --libs` -lgeos_c -llwgeom -lpq -lboost_serialization-mt -lboost_filesystem-mt -lboost_system-mt -lboost_mpi-mt -lmpi
+// ./lineorder "dbname=osm" minx miny maxx maxy
+
+/**
+ * Compare the time and cache misses it takes to build the topology of a zone
+ * for each line insertion order.
+ */
+
+#include <chrono>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <geos_c.h>
+#include <ogrsf_frmts.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include <pg.h>
+#include <build.h>
+#include <utils.h>
+#include <zones.h>
+#include <topology.h>
+
+#include <boost/mpi/environment.hpp>
+
+using namespace cma;
+using namespace std;
+
+/**
+ * Hardware counter of the calling thread (-1 when not available).
+ */
+class hw_counter
+{
+public:
+    hw_counter(uint64_t config) {
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        _fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~hw_counter() {
+#ifdef __linux__
+        if (_fd >= 0) close(_fd);
+#endif
+    }
+
+    void start() {
+#ifdef __linux__
+        if (_fd < 0) return;
+        ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    int64_t stop() {
+#ifdef __linux__
+        if (_fd < 0) return -1;
+        ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+
+        int64_t count;
+        if (read(_fd, &count, sizeof(count)) != sizeof(count)) {
+            return -1;
+        }
+        return count;
+#else
+        return -1;
+#endif
+    }
+
+private:
+    int _fd = -1;
+};
+
+int main(int argc, char** argv)
+{
+    boost::mpi::environment env;
+
+    if (argc != 6) {
+        cerr << "usage: " << argv[0] << " <connect string> minx miny maxx maxy" << endl;
+        return 1;
+    }
+
+    OGREnvelope envelope;
+    envelope.MinX = atof(argv[2]);
+    envelope.MinY = atof(argv[3]);
+    envelope.MaxX = atof(argv[4]);
+    envelope.MaxY = atof(argv[5]);
+
+    initGEOS(geos_message_function, geos_message_function);
+
+    GEOSHelper geos;
+    assert (hdl != NULL);
+
+    PG db(argv[1]);
+    if (!db.connected()) {
+        cerr << "Could not connect to PostgreSQL." << endl;
+        return 1;
+    }
+
+    GEOSGeometry* zoneGeom = OGREnvelope2GEOSGeom(envelope);
+
+#ifdef __linux__
+    hw_counter misses(PERF_COUNT_HW_CACHE_MISSES);
+    hw_counter references(PERF_COUNT_HW_CACHE_REFERENCES);
+#else
+    hw_counter misses(0);
+    hw_counter references(0);
+#endif
+
+    const char* orders[] = { "id", "hilbert" };
+    for (const char* order : orders) {
+        linesV lines;
+        if (!db.get_lines(zoneGeom, lines, true)) {
+            cerr << "Could not fetch lines." << endl;
+            return 1;
+        }
+        size_t line_count = lines.size();
+
+        if (parse_line_order(order) == ORDER_HILBERT) {
+            hilbert_sort(envelope, lines);
+        }
+
+        Topology* topology = new Topology(&geos);
+
+        auto start = chrono::steady_clock::now();
+        misses.start();
+        references.start();
+
+        add_lines(topology, lines);
+
+        int64_t ref_count = references.stop();
+        int64_t miss_count = misses.stop();
+        auto end = chrono::steady_clock::now();
+        auto elapsed = chrono::duration_cast<chrono::milliseconds>(end - start);
+
+        cout << order << ": " << line_count << " lines in " << elapsed.count() << " ms, "
+             << "cache misses: " << miss_count << "/" << ref_count;
+        if (miss_count >= 0 && ref_count > 0) {
+            cout << " (" << miss_count / double(ref_count) * 100 << "%)";
+        }
+        cout << endl;
+        topology->print_stats();
+
+        delete topology;
+    }
+
+    GEOSGeom_destroy_r(hdl, zoneGeom);
+    finishGEOS();
+
+    return 0;
+}
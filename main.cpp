@@ -11,7 +11,13 @@
 #include <ogrsf_frmts.h>
 
 #include <pg.h>
+#include <dag.h>
+#include <build.h>
+#include <catalog.h>
+#include <fixed.h>
 #include <merge.h>
+#include <output.h>
+#include <store.h>
 #include <utils.h>
 #include <zones.h>
 #include <topology.h>
@@ -35,29 +41,31 @@ using namespace boost::algorithm;
 
 namespace po = boost::program_options;
 
-namespace cma {
-    GEOSContextHandle_t hdl;
-}
-
-bool slave_exchange_topologies(
-    GEOSHelper* geos,
-    vector<int>& newTopologies);
-
-void exchange_topologies(
-    GEOSHelper* geos,
-    pair<zone*, int>& fz1,
-    pair<zone*, int>& fz2,
-    vector<int>& newTopologies);
-
 int main(int argc, char **argv)
 {
-    environment env;
+    // merge threads (--merge-threads) use MPI (e.g. communicator::rank()) too
+    environment env(argc, argv, threading::multiple);
     communicator world;
 
     int ret = -1;
     bool merge_only = false;
     bool restore = true;
     int first_merge_step = 0;
+    int subcell_depth = 0;
+    double grid = 0.;
+    bool deferred_faces = false;
+    bool bulk_build = false;
+    int face_cache_size = 256;
+    double line_budget = 0.;
+    bool resident = false;
+    bool seam_merge = false;
+    bool catalog = false;
+    bool distributed_output = false;
+    int output_levels = 1;
+    int checkpoint_interval = 4;
+    int cache_size = 0;
+    int merge_threads = 1;
+    line_order_type line_order = ORDER_ID;
     string postgres_connect_str;
     po::variables_map vm;
     if (world.rank() == 0) {
@@ -67,7 +75,22 @@ int main(int argc, char **argv)
             ("db", po::value<string>()->required(), "PostgreSQL connect string (required)")
             ("merge-only", "Skip to merge phase (default: 0/false)")
             ("no-merge-restore", "Don't restore merged topologies (default: restore)")
-            ("merge-step", po::value<int>()->default_value(0), "Merge step to resume (default: 0/all steps)")
+            ("merge-step", po::value<int>()->default_value(0), "Number of merge groups already merged to resume from (default: 0)")
+            ("catalog", "Assign lines to zones once (catalog.bin) and fetch them by id instead of spatial queries")
+            ("seam-merge", "Only index the merged topologies around the orphan lines (default: whole topologies)")
+            ("resident", "Keep topologies in memory and send them to the merging rank over MPI (default: through .ser files)")
+            ("merge-threads", po::value<int>()->default_value(1), "Threads merging the groups a rank gets at once, each with its own database connection (default: 1)")
+            ("cache-size", po::value<int>()->default_value(0), "Memory budget in MB of the topologies kept by each rank for its next merges (default: 0/no cache, unbounded with --resident)")
+            ("checkpoint-interval", po::value<int>()->default_value(4), "With --resident, save topologies to disk every n merge tasks of a rank, 0 for never (default: 4)")
+            ("distributed-output", "Leave the top merge levels undone and write one output slice per rank instead of topology.ser")
+            ("output-levels", po::value<int>()->default_value(1), "With --distributed-output, number of top merge levels left undone (default: 1)")
+            ("line-order", po::value<string>()->default_value("id"), "Line insertion order: id or hilbert (default: id)")
+            ("grid-size", po::value<double>()->default_value(0.), "Snap coordinates to a fixed grid of that size in meters, e.g. 1e-6 (default: 0/off)")
+            ("face-cache-size", po::value<int>()->default_value(256), "Face geometry cache size per topology in MB (default: 256)")
+            ("line-budget", po::value<double>()->default_value(0.), "Seconds a line may take before being quarantined and retried last (default: 0/off)")
+            ("bulk-build", "Build zones from all of their lines at once instead of one line at a time")
+            ("deferred-faces", "Compute faces in one pass once all lines are added (default: incremental)")
+            ("subcell-depth", po::value<int>()->default_value(0), "Split zones into 4^n sub-cells built by all threads (default: 0/serial)")
         ;
 
         try {
@@ -83,10 +106,32 @@ int main(int argc, char **argv)
                 restore = !vm.count("no-merge-restore");
                 postgres_connect_str = vm["db"].as<string>();
                 first_merge_step = vm["merge-step"].as<int>();
+                subcell_depth = vm["subcell-depth"].as<int>();
+                line_order = parse_line_order(vm["line-order"].as<string>());
+                grid = vm["grid-size"].as<double>();
+                deferred_faces = vm.count("deferred-faces");
+                bulk_build = vm.count("bulk-build");
+                face_cache_size = vm["face-cache-size"].as<int>();
+                line_budget = vm["line-budget"].as<double>();
+                resident = vm.count("resident");
+                seam_merge = vm.count("seam-merge");
+                catalog = vm.count("catalog");
+                checkpoint_interval = vm["checkpoint-interval"].as<int>();
+                cache_size = vm["cache-size"].as<int>();
+                merge_threads = vm["merge-threads"].as<int>();
+                distributed_output = vm.count("distributed-output");
+                output_levels = vm["output-levels"].as<int>();
+                if (output_levels < 1) {
+                    throw invalid_argument("--output-levels must be at least 1");
+                }
+                set_grid_size(grid);
             }
         } catch (const po::required_option&) {
             cerr << desc << endl;
             ret = 1;
+        } catch (const invalid_argument& ex) {
+            cerr << ex.what() << endl << desc << endl;
+            ret = 1;
         }
     }
 
@@ -98,6 +143,34 @@ int main(int argc, char **argv)
     broadcast(world, restore, 0);
     broadcast(world, merge_only, 0);
     broadcast(world, first_merge_step, 0);
+    broadcast(world, subcell_depth, 0);
+    broadcast(world, line_order, 0);
+    broadcast(world, grid, 0);
+    broadcast(world, deferred_faces, 0);
+    broadcast(world, bulk_build, 0);
+    broadcast(world, face_cache_size, 0);
+    broadcast(world, line_budget, 0);
+    broadcast(world, resident, 0);
+    broadcast(world, seam_merge, 0);
+    broadcast(world, checkpoint_interval, 0);
+    broadcast(world, cache_size, 0);
+    broadcast(world, merge_threads, 0);
+    if (merge_threads > 1 && environment::thread_level() < threading::multiple) {
+        cerr << "[" << world.rank() << "] MPI does not support MPI_THREAD_MULTIPLE, merging with 1 thread." << endl;
+        merge_threads = 1;
+    }
+    set_merge_threads(merge_threads);
+    broadcast(world, distributed_output, 0);
+    face_geometry_cache::default_capacity(size_t(face_cache_size) << 20);
+    set_grid_size(grid);
+    Topology::defer_faces(deferred_faces);
+    Topology::line_budget(line_budget);
+    topology_store::resident(resident);
+    topology_store::budget(size_t(cache_size) << 20);
+    topology_store::checkpoint_interval(checkpoint_interval);
+    if (line_budget > 0) {
+        set_quarantine_file("quarantine-" + to_string(world.rank()) + ".txt");
+    }
     broadcast(world, postgres_connect_str, 0);
 
     initGEOS(geos_message_function, geos_message_function);
@@ -106,8 +179,6 @@ int main(int argc, char **argv)
     unique_ptr<GEOSHelper> geos(new GEOSHelper());
     assert (hdl != NULL);
 
-    geom_container::s_wkbr = GEOSWKBReader_create();
-
     PG db(postgres_connect_str);
     if (!db.connected()) {
         cerr << "Could not connect to PostgreSQL." << endl;
@@ -135,13 +206,16 @@ int main(int argc, char **argv)
     vector<zone*> orderedZones;
     vector<depth_group_t> groups;
     int processingLineCount = 0;
+    uint64_t catalog_fingerprint = 0;
     if (world.rank() == 0) {
         GEOSGeometry* world_extent = world_geom();
         cout << "world geom: " << geos->as_string(world_extent) << endl;
 
+        bool prepared = false;
         if (!restore_zones(zones, groups)) {
             prepare_zones(postgres_connect_str, *geos, world_extent, zones, groups, 20);
             save_zones(zones, groups);
+            prepared = true;
         }
         assert (!zones.empty());
         assert (!groups.empty());
@@ -180,6 +254,41 @@ int main(int argc, char **argv)
 
         cout << "Will process " << processingLineCount << ", leaving " << line_count-processingLineCount
              << " orphans (" << (line_count-processingLineCount)/float(processingLineCount)*100 << "%)" << endl;
+
+        // a catalog of other zones or lines would assign lines to the wrong groups
+        catalog_fingerprint = line_catalog::fingerprint(orderedZones, groups, line_count);
+        if (catalog && (prepared || !line_catalog::instance().open("catalog.bin", catalog_fingerprint))) {
+            if (!line_catalog::build(db, orderedZones, groups, catalog_fingerprint, "catalog.bin")) {
+                cerr << "Could not build the line catalog, falling back to spatial queries." << endl;
+                catalog = false;
+            }
+        }
+    }
+
+    /**
+     * In distributed output mode the groups of the top levels are not
+     * merged, the zones they would merge are the output partitions.
+     */
+    vector<depth_group_t> seam_groups;
+    int partition_count = 1;
+    if (world.rank() == 0 && distributed_output) {
+        int top_depth = groups.back().first - output_levels;
+        auto first_top = find_if(groups.begin(), groups.end(), [top_depth](const depth_group_t& g) {
+            return g.first > top_depth;
+        });
+        seam_groups.assign(first_top, groups.end());
+        groups.erase(first_top, groups.end());
+        partition_count = zones.size() - 3 * groups.size();
+
+        cout << "distributed output: " << partition_count << " partitions, "
+             << seam_groups.size() << " top merge groups left undone" << endl;
+    }
+    broadcast(world, partition_count, 0);
+
+    broadcast(world, catalog, 0);
+    broadcast(world, catalog_fingerprint, 0);
+    if (catalog && !line_catalog::instance().open("catalog.bin", catalog_fingerprint)) {
+        cerr << "[" << world.rank() << "] could not open catalog.bin, falling back to spatial queries." << endl;
     }
 
     list<zone*> myZones;
@@ -220,7 +329,13 @@ int main(int argc, char **argv)
             GEOSWKTReader_read_r(hdl, geos->text_reader(), hexWKT.c_str());
 
         linesV lines;
-        if (!db.get_lines(zoneGeom, lines, true)) {
+        vector<int> lineIds;
+        if (line_catalog::instance().is_open() && line_catalog::instance().lines(z->envelope(), lineIds)) {
+            if (!db.get_lines(lineIds, lines)) {
+                assert (false);
+            }
+        }
+        else if (!db.get_lines(zoneGeom, lines, true)) {
             assert (false);
         }
 
@@ -234,43 +349,51 @@ int main(int argc, char **argv)
         if (lines.size() == 0) {
             Topology* topology = new Topology(geos.get());
             topology->zoneId(z->id());
-            save_topology(geos.get(), z, topology);
-            delete topology;
+            if (!resident) {
+                save_topology(geos.get(), z, topology);
+            }
+            if (topology_store::enabled()) {
+                topology_store::instance().put(geos.get(), z, topology, !resident);
+            }
+            else {
+                delete topology;
+            }
             continue;
         }
 
-        topology = new Topology(geos.get());
-        topology->zoneId(z->id());
+        size_t skipped = prescreen_lines(lines);
+        if (skipped > 0) {
+            cout << "[" << world.rank() << "] " << skipped << " degenerate lines skipped in zone #"
+                 << zoneId << endl;
+        }
 
-        int lc = 0;
-        for (pair<int, GEOSGeometry*>& line_info : lines) {
-            int lineId = line_info.first;
-            GEOSGeometry* line = line_info.second;
-            try {
-                topology->TopoGeo_AddLineString(lineId, line, DEFAULT_TOLERANCE);
-                topology->commit();
-            }
-            catch (const runtime_error& ex) {
-                cerr << "Line #" << topology->count() << " - " << geos->as_string(line) << ": " << ex.what() << endl;
-                cerr << "Cannot complete topology for zone id #" << topology->zoneId() << endl;
-                topology->rollback();
-                delete topology;
-                topology = new Topology();
-                topology->zoneId(z->id());
-                break;
-            }
-            catch (const invalid_argument& ex) {
-                cerr << "Line #" << topology->count() << " - " << geos->as_string(line) << ": " << ex.what() << endl;
-                topology->rollback();
-            }
+        if (line_order == ORDER_HILBERT) {
+            hilbert_sort(z->envelope(), lines);
+        }
 
-            GEOSGeom_destroy_r(hdl, line);
+        bool complete;
+        if (subcell_depth > 0) {
+            topology = build_topology(z->envelope(), lines, subcell_depth, DEFAULT_TOLERANCE, true);
+            complete = topology != nullptr;
+        }
+        else if (bulk_build) {
+            topology = new Topology(geos.get());
+            complete = bulk_add_lines(topology, lines, DEFAULT_TOLERANCE);
+        }
+        else {
+            topology = new Topology(geos.get());
+            complete = add_lines(topology, lines, DEFAULT_TOLERANCE, true);
+        }
 
-            if (++lc % 100 == 0) {
-                // cout << lc << endl;
-            }
+        if (!complete) {
+            cerr << "Cannot complete topology for zone id #" << zoneId << endl;
+            delete topology;
+            topology = new Topology();
+        }
+        else {
+            topology->build_faces();
         }
-        lines.clear();
+        topology->zoneId(z->id());
 
         end = chrono::system_clock::now();
         chrono::duration<double> elapsed_seconds = end-start;
@@ -281,13 +404,22 @@ int main(int argc, char **argv)
              << " at " << t << ","
              << " elapsed time: " << elapsed_seconds.count() << "s" << endl;
 
-        save_topology(geos.get(), z, topology);
-        delete topology;
+        if (!resident) {
+            save_topology(geos.get(), z, topology);
+        }
+        if (topology_store::enabled()) {
+            topology_store::instance().put(geos.get(), z, topology, !resident);
+        }
+        else {
+            delete topology;
+        }
     }
 
-    broadcast(world, zones, 0);
+    if (resident && checkpoint_interval > 0) {
+        topology_store::instance().checkpoint(geos.get());
+    }
 
-    vector<int> topologiesToMerge;
+    broadcast(world, zones, 0);
 
     for (depth_group_t g : groups) {
         vector<string> gs;
@@ -297,194 +429,38 @@ int main(int argc, char **argv)
         cout << join(gs, ",") << endl;
     }
  
-    int merge_step = 0;
-    int orphan_count = 0;
-    while (zones.size() > 1)
-    {
-        int nextRank;
-        int current_depth;
-        vector<zone*> to_delete;
-
-        chrono::time_point<chrono::system_clock> _start, _end;
-        _start = chrono::system_clock::now();
-
-        vector<depth_group_t> next_groups;
-        if (world.rank() == 0) {
-            assert (groups.size() > 0);
-            assert (orderedZones.size() == zones.size());
-
-            get_next_groups(groups, next_groups);
-            assert (next_groups.size() > 0);
-
-            if (merge_step < first_merge_step)
-            {
-                /**
-                 * If we skip a step, we need to compute the merged zones envelope.
-                 */
-                cout << "[" << world.rank() << "] skipping merge step " << merge_step << endl;
-                for (int gIdx = 0; gIdx < next_groups.size(); ++gIdx) {
-
-                    int mergedZoneId = next_groups[gIdx].second[0];
-                    OGREnvelope envelope = get_zone_by_id(zones, next_groups[gIdx].second[0])->envelope();
-
-                    assert (next_groups[gIdx].second.size() == 4);
-
-                    to_delete.clear();
-                    for (int i = 0; i < 4; ++i) {
-                        if (i > 0) {
-                            envelope.Merge(get_zone_by_id(zones, next_groups[gIdx].second[i])->envelope());
-                        }
-
-                        zone* z = *find_if(
-                            begin(zones),
-                            end(zones),
-                            [next_groups,gIdx,i](const zone* z) {
-                                return z->id() == next_groups[gIdx].second[i];
-                            }
-                        );
-
-                        to_delete.push_back(z);
-                    }
-
-                    zone* merged_zone = new zone(mergedZoneId, envelope);
-
-                    orderedZones.insert(
-                        find_if(
-                            begin(orderedZones),
-                            end(orderedZones),
-                            [merged_zone](const zone* a) {
-                                return merged_zone->id() == a->id();
-                            }
-                        ),
-                        merged_zone
-                    );
-                    zones.push_back(merged_zone);
-
-                    for (zone* z : to_delete) {
-                        zones.erase(find(begin(zones), end(zones), z));
-                        orderedZones.erase(find(begin(orderedZones), end(orderedZones), z));
-                    }
-                    to_delete.clear();
-                }
-
-                broadcast(world, zones, 0);
-                ++merge_step;
-                continue;
-            }
-
-            cout << "[" << world.rank() << "] merge step " << merge_step++
-                 << " (zone count: " << zones.size() << ", group count: "
-                 << next_groups.size() << ")" << endl;
-
-            nextRank = 0;
-
-            for (int gIdx = 0; gIdx < next_groups.size(); ++gIdx) {
-                // broadcast a pair of <zone*, rank> so the right rank can load it from disk
-                pair<zone*, int> fz1 = make_pair(
-                    get_zone_by_id(zones, next_groups[gIdx].second[0]),
-                    nextRank);
-                pair<zone*, int> fz2 = make_pair(
-                    get_zone_by_id(zones, next_groups[gIdx].second[1]),
-                    nextRank);
-                broadcast(world, fz1, 0);
-                broadcast(world, fz2, 0);
-                cout << "[" << world.rank() << "] queuing join of topologies #" << fz1.first->id() << " and " << fz2.first->id() << endl;
-                exchange_topologies(geos.get(), fz1, fz2, topologiesToMerge);
-
-                fz1 = make_pair(
-                    get_zone_by_id(zones, next_groups[gIdx].second[2]),
-                    nextRank);
-                fz2 = make_pair(
-                    get_zone_by_id(zones, next_groups[gIdx].second[3]),
-                    nextRank);
-                broadcast(world, fz1, 0);
-                broadcast(world, fz2, 0);
-                cout << "[" << world.rank() << "] queuing join of topologies #" << fz1.first->id() << " and " << fz2.first->id() << endl;
-                exchange_topologies(geos.get(), fz1, fz2, topologiesToMerge);
-
-                if (++nextRank == world.size()) {
-                    nextRank = 0;
-                }
-
-                // delay deletion of those 4 zones after merge
-                for (int i = 0; i < 4; ++i) {
-                    zone* z = *find_if(
-                        begin(zones),
-                        end(zones),
-                        [next_groups,gIdx,i](const zone* z) {
-                            return z->id() == next_groups[gIdx].second[i];
-                        }
-                    );
-                    to_delete.push_back(z);
-                }
-            }
-
-            // signal that we're done for this round of merging
-            pair<zone*, int> fz1 = make_pair(nullptr, -1);
-            broadcast(world, fz1, 0);
-        }
-        else {
-            if (merge_step < first_merge_step) {
-                delete_all(zones);
-                broadcast(world, zones, 0);
-                ++merge_step;
-                continue;
-            }
+    /**
+     * groups is only known to rank 0, merge_zones() is collective even
+     * when there is nothing left to merge.
+     */
+    int orphan_count = merge_zones(db, geos.get(), zones, orderedZones, groups,
+                                   first_merge_step, restore, seam_merge);
 
-            slave_exchange_topologies(geos.get(), topologiesToMerge);
-        }
-
-        // pair-wise merge
-        vector<zone*> newZones;
-        orphan_count +=
-            merge_topologies(db, geos.get(), zones, topologiesToMerge, newZones, restore);
-        assert (topologiesToMerge.empty());
-
-        vector< vector<zone*> > vz;
-        gather(world, newZones, vz, 0);
-
-        if (world.rank() == 0) {
-            register_zones(vz, zones, orderedZones);
-        }
-        else {
-            // rank 0 is the sole owner of this zones until the
-            // next broadcast
-            delete_all(zones);
-            delete_all(newZones);
-        }
-
-        for (zone* z : to_delete) {
-            zones.erase(find(begin(zones), end(zones), z));
-            orderedZones.erase(find(begin(orderedZones), end(orderedZones), z));
+    if (world.rank() == 0) {
+        int processed = 0;
+        for (const zone* z : zones) {
+            processed += z->count();
         }
-        to_delete.clear();
-
-        broadcast(world, zones, 0);
-
-        if (world.rank() == 0) {
-            for (const zone* z : zones) {
-                cout << "zone #" << z->id() << " count: " << z->count() << endl;
-            }
-
-            _end = chrono::system_clock::now();
-            chrono::duration<double> elapsed_seconds = _end-_start;
-            time_t end_time = chrono::system_clock::to_time_t(_end);
+        cout << orphan_count << " total orphans added." << endl;
+        cout << "total processed lines: " << processed << endl;
+    }
 
-            char* t = std::ctime(&end_time); t[strlen(t)-2] = '\0';
-            cout << "[" << world.rank() << "] merge step " << (merge_step-1)
-                 << " at " << t << ","
-                 << " elapsed time: " << elapsed_seconds.count() << "s" << endl;
+    assert (zones.size() == partition_count);
+    if (distributed_output) {
+        // the orphans of the groups left undone are added to the partitions they cross
+        vector<int> seam_lines;
+        if (world.rank() == 0 && !get_seam_lines(db, zones, seam_groups, seam_lines)) {
+            cerr << "Could not query the seam lines." << endl;
+            world.abort(1);
         }
+        broadcast(world, seam_lines, 0);
+        write_partitions(db, geos.get(), zones, seam_lines);
     }
-
-    if (world.rank() == 0) {
-        cout << orphan_count << " total orphans added." << endl;
-        cout << "total processed lines: " << zones[0]->count() << endl;
+    else if (resident) {
+        topology_store::instance().transfer(geos.get(), zones[0]->id(), 0);
     }
-
-    assert (zones.size() == 1);
-    if (world.rank() == 0) {
-        Topology *topology = restore_topology(geos.get(), zones[0], false);
+    if (world.rank() == 0 && !distributed_output) {
+        Topology *topology = topology_store::instance().fetch(geos.get(), zones[0]);
         std::ofstream ofs("topology.ser");
         boost::archive::binary_oarchive oa(ofs);
         oa << *topology;
@@ -508,50 +484,3 @@ int main(int argc, char **argv)
 
     return 0;
 }
-
-bool slave_exchange_topologies(
-    GEOSHelper* geos,
-    vector<int>& newTopologies)
-{
-    communicator world;
-
-    pair<zone*, int> fz1;
-    pair<zone*, int> fz2;
-
-    do {
-        broadcast(world, fz1, 0);
-        if (fz1.first != nullptr) {
-            broadcast(world, fz2, 0);
-            assert (fz1.second == fz2.second);
-
-            exchange_topologies(
-                geos,
-                fz1, fz2,
-                newTopologies
-            );
-        }
-    } while (fz1.first != nullptr);
-}
-
-void exchange_topologies(
-    GEOSHelper* geos,
-    pair<zone*, int>& fz1,
-    pair<zone*, int>& fz2,
-    vector<int>& newTopologies)
-{
-    communicator world;
-
-    if (world.rank() == fz1.second) {
-        newTopologies.push_back(fz1.first->id());
-        newTopologies.push_back(fz2.first->id());
-
-        if (newTopologies[newTopologies.size()-2] != fz1.first->id()) {
-            assert (newTopologies[newTopologies.size()-1] == fz1.first->id());
-            assert (newTopologies[newTopologies.size()-2] == fz2.first->id());
-            swap(
-                newTopologies[newTopologies.size()-1],
-                newTopologies[newTopologies.size()-2]
-            );
-        }
-    }
-}
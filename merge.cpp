@@ -1,8 +1,13 @@
 #include <merge.h>
 
+#include <build.h>
+#include <catalog.h>
+#include <store.h>
 #include <zones.h>
 
+#include <omp.h>
 #include <chrono>
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <functional>
@@ -16,6 +21,65 @@ namespace cma {
 
 typedef vector<int> itemid_map;
 
+/**
+ * Threads merging groups in merge_groups().
+ */
+static int merge_threads = 1;
+
+void set_merge_threads(int threads)
+{
+    merge_threads = max(threads, 1);
+}
+
+int merge_thread_count()
+{
+    return merge_threads;
+}
+
+/**
+ * Append the entries of an R-tree to another one, remapping their ids.
+ */
+template <class IndexType, class Value>
+static void merge_index(IndexType& idx1, const IndexType& idx2, const itemid_map& id_map)
+{
+    vector<Value> values;
+    values.reserve(idx2.size());
+    for (const Value& v : idx2) {
+        values.push_back(make_pair(v.first, id_map[v.second]));
+    }
+    idx1.insert(values.begin(), values.end());
+}
+
+/**
+ * Append the face edge sets of t2 to those of t1: the universal face set
+ * goes to the universal face, other faces follow the order in which they
+ * were appended to t1 starting at firstFaceId.
+ */
+static void merge_face_index(
+    vector<edgeid_set_ptr>& idx1,
+    const vector<edgeid_set_ptr>& idx2,
+    int firstFaceId,
+    const itemid_map& edge_map)
+{
+    assert (idx1.size() == firstFaceId);
+
+    for (int i = 0; i < idx2.size(); ++i) {
+        edgeid_set_ptr set;
+        if (i == 0) {
+            set = idx1[0];
+        }
+        else {
+            set = edgeid_set_ptr(new edgeid_set);
+            idx1.push_back(set);
+        }
+
+        if (!idx2[i]) continue;
+        for (int edgeId : *idx2[i]) {
+            set->insert(edge_map[edgeId]);
+        }
+    }
+}
+
 void merge_topologies(Topology& t1, Topology& t2)
 {
     assert (t1._transactions->empty());
@@ -31,12 +95,12 @@ void merge_topologies(Topology& t1, Topology& t2)
 
     int nextNodeId;
     int newEdgeId, nextEdgeId;
-    int nextFaceId;
+    int firstFaceId, nextFaceId;
     int nextTopogeoId;
 
     nextNodeId = t1._nodes.size();
     newEdgeId = nextEdgeId = t1._edges.size();
-    nextFaceId = t1._faces.size();
+    firstFaceId = nextFaceId = t1._faces.size();
     nextTopogeoId = t1._relations.size();
 
     for (int nodeId = 1; nodeId < t2._nodes.size(); ++nodeId) {
@@ -101,6 +165,10 @@ void merge_topologies(Topology& t1, Topology& t2)
     t1._topogeom_relations->insert(
         t2._topogeom_relations->begin(), t2._topogeom_relations->end());
 
+    t1._totalCount += t2._totalCount;
+    t1._stale_faces = t1._stale_faces || t2._stale_faces;
+    t1._ring_stats.merge(t2._ring_stats);
+
     for (int i = newEdgeId; i < t1._edges.size(); ++i) {
         edge* e = t1._edges[i];
         if (!e) continue;
@@ -111,11 +179,30 @@ void merge_topologies(Topology& t1, Topology& t2)
         e->next_left_edge  = e->next_left_edge  < 0 ? -(*edge_map)[abs(e->next_left_edge)]  : (*edge_map)[e->next_left_edge];
         e->next_right_edge = e->next_right_edge < 0 ? -(*edge_map)[abs(e->next_right_edge)] : (*edge_map)[e->next_right_edge];
 
-        e->abs_next_left_edge  = (*edge_map)[e->abs_next_left_edge];
-        e->abs_next_right_edge = (*edge_map)[e->abs_next_right_edge];
-
         e->left_face  = (*face_map)[e->left_face];
         e->right_face = (*face_map)[e->right_face];
+
+        t1._store_links(e);
+    }
+
+    /**
+     * Carry the indexes of both topologies over instead of recomputing
+     * every edge envelope and node buffer in rebuild_indexes(): boxes are
+     * unchanged, only ids need remapping.
+     */
+    if (t1._index && t2._index) {
+        merge_index<edge_idx_t, edge_value>(*t1._edge_idx, *t2._edge_idx, *edge_map);
+        merge_index<edge_idx_t, edge_value>(*t1._edge_tol_idx, *t2._edge_tol_idx, *edge_map);
+        merge_index<node_idx_t, node_value>(*t1._node_idx, *t2._node_idx, *node_map);
+        merge_index<edge_idx_t, edge_value>(*t1._node_tol_idx, *t2._node_tol_idx, *node_map);
+
+        merge_face_index(*t1._left_faces_idx, *t2._left_faces_idx, firstFaceId, *edge_map);
+        merge_face_index(*t1._right_faces_idx, *t2._right_faces_idx, firstFaceId, *edge_map);
+        assert (t1._left_faces_idx->size() == t1._faces.size());
+    }
+    else {
+        // rebuild_indexes() will be needed
+        t1._index = false;
     }
 
     t2._empty(false);
@@ -127,7 +214,27 @@ int merge_topologies(
     vector<zone*> zones,
     vector<int>& topologies,
     vector<zone*>& new_zones,
-    bool merge_restore)
+    bool merge_restore,
+    bool seam_only)
+{
+    int orphan_count = merge_groups(db, geos, zones, topologies, new_zones, merge_restore, seam_only);
+
+    communicator world;
+
+    int total_orphan_count;
+    reduce(world, orphan_count, total_orphan_count, std::plus<int>(), 0);
+    return total_orphan_count;
+}
+
+int merge_groups(
+    PG& db,
+    GEOSHelper* geos,
+    vector<zone*> zones,
+    vector<int>& topologies,
+    vector<zone*>& new_zones,
+    bool merge_restore,
+    bool seam_only,
+    vector<group_merge_stats>* stats)
 {
     assert (new_zones.empty());
 
@@ -136,77 +243,81 @@ int merge_topologies(
     int orphan_count = 0;
 
     assert (topologies.size() % 4 == 0);
+    int group_count = topologies.size()/4;
+
+    // other threads query orphans on their own connection
+    int threads = min(merge_threads, group_count);
+    vector< unique_ptr<PG> > connections(1);
+    for (int i = 1; i < threads; ++i) {
+        connections.emplace_back(new PG(db.connect_str()));
+        if (!connections.back()->connected()) {
+            cerr << "[" << world.rank() << "] could not open connection #" << i
+                 << ", merging with " << i << " threads" << endl;
+            connections.pop_back();
+            threads = i;
+        }
+    }
+
+    // groups do not share any zone, zones is only read below
+    vector<zone*> merged(group_count, nullptr);
+    vector<group_merge_stats> group_stats(group_count);
+    int done = 0;
 
-    for (int i = 0; i < topologies.size()/4; ++i)
+    #pragma omp parallel num_threads(threads) reduction(+:orphan_count) if(threads > 1)
     {
-        vector<zone*> temp_new_zones;
-        Topology* t[2] = {nullptr, nullptr};
+        int thread = omp_get_thread_num();
+        GEOSHelper* thread_geos_helper = thread == 0 ? geos : thread_geos();
+        PG& thread_db = thread == 0 ? db : *connections[thread];
 
-        for (int j = 0; j < 2; ++j)
+        #pragma omp for schedule(dynamic, 1)
+        for (int i = 0; i < group_count; ++i)
         {
-            Topology* t1 = restore_topology(geos, get_zone_by_id(zones, topologies[i*4+j*2]), false);
-            Topology* t2 = restore_topology(geos, get_zone_by_id(zones, topologies[i*4+j*2+1]), false);
-            if (!t1) {
-                cout << "[" << world.rank() << "] (fatal t1) topology for zone #" << topologies[i*4+j*2] << " could not be restored" << endl;
+            auto start = chrono::steady_clock::now();
+
+            vector<Topology*> t(4, nullptr);
+            for (int j = 0; j < 4; ++j) {
+                t[j] = topology_store::instance().fetch(thread_geos_helper, get_zone_by_id(zones, topologies[i*4+j]));
+                if (!t[j]) {
+                    cout << "[" << world.rank() << "] (fatal t" << j << ") topology for zone #" << topologies[i*4+j] << " could not be restored" << endl;
+                }
             }
-            if (!t2) {
-                cout << "[" << world.rank() << "] (fatal t2) topology for zone #" << topologies[i*4+j*2+1] << " could not be restored" << endl;
+            assert (t[0] && t[1] && t[2] && t[3]);
+
+            // all 4 topologies at once, with a single orphan query and insertion pass
+            vector<zone*> group_zones;
+            int orphans = _internal_merge(thread_db, thread_geos_helper, zones, t, group_zones, merge_restore, seam_only);
+            orphan_count += orphans;
+            assert (group_zones.size() == 1);
+            merged[i] = group_zones[0];
+
+            if (topology_store::enabled()) {
+                // unless resident, merged topology has already been saved in _internal_merge
+                topology_store::instance().put(thread_geos_helper, merged[i], t[0], !topology_store::resident());
             }
-            assert (t1 && t2);
-
-            int z2_id = t2->zoneId();
-
-            Topology* t1t = t1;
-            orphan_count +=
-                _internal_merge(db, geos, zones, &t1, t2, temp_new_zones, merge_restore);
-            if (t1 != t1t) {
-                // a swap occured
-                topologies[i*4+j*2] = t1->zoneId();
+            else {
+                // merged topology has already been saved in _internal_merge
+                delete t[0];
             }
 
-            t[j] = t1;
+            chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+            group_stats[i].orphans = orphans;
+            group_stats[i].seconds = elapsed.count();
 
-            zones.erase(find_if(zones.begin(), zones.end(), [t1](const zone* z) {
-                return z->id() == t1->zoneId();
-            }));
-            zones.erase(find_if(zones.begin(), zones.end(), [z2_id](const zone* z) {
-                return z->id() == z2_id;
-            }));
-        }
-        assert (t[0] && t[1]);
-        assert (temp_new_zones.size() == 2);
-
-        // replace zones in the original vector with the new (temporary) ones
-        zones.insert(zones.end(), temp_new_zones.begin(), temp_new_zones.end());
-
-        int z2_id = t[1]->zoneId();
-
-        orphan_count += _internal_merge(db, geos, zones, &t[0], t[1], new_zones, merge_restore);
-
-        zones.erase(find_if(zones.begin(), zones.end(), [t](const zone* z) {
-            return z->id() == t[0]->zoneId();
-        }));
-        zones.erase(find_if(zones.begin(), zones.end(), [z2_id](const zone* z) {
-            return z->id() == z2_id;
-        }));
-        zones.push_back(new_zones[new_zones.size()-1]);
-
-        // delete temporary zones
-        for (zone* z : temp_new_zones) {
-            delete z;
+            int progress;
+            #pragma omp critical(merge_progress)
+            progress = int(float(++done) / group_count * 100.0);
+            cout << "[" << world.rank() << "] progress: " << progress << "%" << endl;
         }
+    }
 
-        // merged topology has already been saved in _internal_merge
-        delete t[0];
+    new_zones.insert(new_zones.end(), merged.begin(), merged.end());
+    topologies.clear();
 
-        int progress = int(float((i+1)) / (topologies.size()/4) * 100.0);
-        cout << "[" << world.rank() << "] progress: " << progress << "%" << endl;
+    if (stats) {
+        *stats = group_stats;
     }
-    topologies.clear();
 
-    int total_orphan_count;
-    reduce(world, orphan_count, total_orphan_count, std::plus<int>(), 0);
-    return total_orphan_count;
+    return orphan_count;
 }
 
 void get_next_groups(
@@ -280,22 +391,36 @@ int _internal_merge(
     PG& db,
     GEOSHelper* geos,
     vector<zone*>& zones,
-    Topology** t1,
-    Topology* t2,
+    vector<Topology*>& topologies,
     vector<zone*>& new_zones,
-    bool merge_restore)
+    bool merge_restore,
+    bool seam_only)
 {
+    assert (topologies.size() == 4);
+
     communicator world;
 
     cout << "_internal_merge merge_restore: " << (merge_restore ? "true" : "false") << endl;
 
     // prepare the merged zone right now to see if we have a checkpoint file
-    zone* z1 = get_zone_by_id(zones, (*t1)->zoneId());
-    zone* z2 = get_zone_by_id(zones, t2->zoneId());
+    vector<zone*> z;
+    vector<OGREnvelope> envelopes;
+    OGREnvelope envelope;
+    int count = 0;
+    for (int i = 0; i < topologies.size(); ++i) {
+        z.push_back(get_zone_by_id(zones, topologies[i]->zoneId()));
+        envelopes.push_back(z[i]->envelope());
+        if (i == 0) {
+            envelope = z[i]->envelope();
+        }
+        else {
+            envelope.Merge(z[i]->envelope());
+        }
+        count += z[i]->count();
+    }
+    zone* merged_zone = new zone(topologies[0]->zoneId(), envelope);
 
-    OGREnvelope envelope = z1->envelope();
-    envelope.Merge(z2->envelope());
-    zone* merged_zone = new zone((*t1)->zoneId(), envelope);
+    Topology*& t1 = topologies[0];
 
     Topology* restored = nullptr;
     if (merge_restore) {
@@ -304,36 +429,62 @@ int _internal_merge(
 
     if (restored) {
         // swap the restored geometry with the current (unmerged) one
-        delete *t1;
-        *t1 = restored;
+        delete t1;
+        t1 = restored;
     }
     else {
-        cout << "[" << world.rank() << "] will merge topologies " << (*t1)->zoneId()
-             << " and " << t2->zoneId() << endl;
-        merge_topologies(**t1, *t2);
+        for (int i = 1; i < topologies.size(); ++i) {
+            cout << "[" << world.rank() << "] will merge topologies " << t1->zoneId()
+                 << " and " << topologies[i]->zoneId() << endl;
+            merge_topologies(*t1, *topologies[i]);
+        }
+    }
+    for (int i = 1; i < topologies.size(); ++i) {
+        delete topologies[i];
+        topologies[i] = nullptr;
     }
-    delete t2;
 
     cout << "[" << world.rank() << "] merge done (or restored)" << endl;
 
     linesV orphans;
     size_t orphan_count;
-    if (!restored || (*t1)->orphan_count() == -1) {         // -1 is for version 0 serializations
-        db.get_common_lines(z1->envelope(), z2->envelope(), orphans);
+    if (!restored || t1->orphan_count() == -1) {         // -1 is for version 0 serializations
+        vector<int> orphanIds;
+        bool fetched = false;
+        if (line_catalog::instance().is_open() && line_catalog::instance().lines(envelope, orphanIds)) {
+            // lines assigned to the merged zone are the orphans of its group
+            fetched = db.get_lines(orphanIds, orphans);
+            if (!fetched) {
+                cerr << "[" << world.rank() << "] could not fetch the catalog orphans of zone #"
+                     << t1->zoneId() << ", falling back to a spatial query" << endl;
+                for (auto& orphan : orphans) {
+                    GEOSGeom_destroy_r(hdl, orphan.second);
+                }
+                orphans.clear();
+            }
+        }
+        if (!fetched && !db.get_group_lines(envelopes, orphans)) {
+            // a merged topology without its orphans must not be saved
+            cerr << "[" << world.rank() << "] (fatal) could not query the orphans of zone #"
+                 << t1->zoneId() << endl;
+            world.abort(1);
+        }
         cout << "[" << world.rank() << "] adding " << orphans.size() << " lines to topology #"
-             << (*t1)->zoneId() << " (lc: " << z1->count() << "/" << (*t1)->count() << "+" << z2->count() << "/" << t2->count() << ")" << endl;
+             << t1->zoneId() << " (lc: " << count << "/" << t1->count() << ")" << endl;
         orphan_count = orphans.size();
     }
     else {
-        orphan_count = (*t1)->orphan_count();
+        orphan_count = t1->orphan_count();
     }
 
-    merged_zone->count(z1->count() + z2->count() + orphan_count);
+    merged_zone->count(count + orphan_count);
     new_zones.push_back(merged_zone);
 
     if (restored) {
-        (*t1)->orphan_count() = orphan_count;
-        save_topology(geos, merged_zone, *t1);
+        t1->orphan_count() = orphan_count;
+        if (!topology_store::resident()) {
+            save_topology(geos, merged_zone, t1);
+        }
 
         for (auto& orphan : orphans) {
             GEOSGeometry *geom = orphan.second;
@@ -344,43 +495,71 @@ int _internal_merge(
         return orphan_count;
     }
 
-    if (!orphans.empty()) {
+    size_t skipped = prescreen_lines(orphans);
+    if (skipped > 0) {
+        cout << "[" << world.rank() << "] " << skipped << " degenerate orphans skipped" << endl;
+    }
+
+    // indexes were carried over by merge_topologies() if both inputs had them
+    if (!orphans.empty() && !t1->indexed()) {
         cout << "[" << world.rank() << "] rebuilding index..." << endl;
         auto start = chrono::steady_clock::now();
-        (*t1)->rebuild_indexes();
+        if (seam_only) {
+            // orphans straddle the seams, the rest of the merged topologies is left unindexed
+            OGREnvelope region;
+            bool empty = true;
+            for (pair<int, GEOSGeometry*>& orphan : orphans) {
+                vector<double> bbox;
+                if (!bounding_box(orphan.second, bbox)) continue;
+
+                if (empty) {
+                    region.MinX = bbox[0];
+                    region.MinY = bbox[1];
+                    region.MaxX = bbox[2];
+                    region.MaxY = bbox[3];
+                    empty = false;
+                }
+                else {
+                    region.MinX = min(region.MinX, bbox[0]);
+                    region.MinY = min(region.MinY, bbox[1]);
+                    region.MaxX = max(region.MaxX, bbox[2]);
+                    region.MaxY = max(region.MaxY, bbox[3]);
+                }
+            }
+            t1->rebuild_indexes(region);
+        }
+        else {
+            t1->rebuild_indexes();
+        }
         auto end = chrono::steady_clock::now();
         auto elapsed = chrono::duration_cast<chrono::milliseconds>(end - start);
         cout << "[" << world.rank() << "] took " << elapsed.count() << " ms." << endl;
     }
 
+    // with the line budget, quarantine and retry pass of zone builds
     auto start = chrono::steady_clock::now();
-    int lc = 0;
-    for (pair<int, GEOSGeometry*>& orphan : orphans) {
-        int lineId = orphan.first;
-        GEOSGeometry* line = orphan.second;
-        try {
-            (*t1)->TopoGeo_AddLineString(lineId, line, DEFAULT_TOLERANCE);
-            (*t1)->commit();
-        }
-        catch (const invalid_argument& ex) {
-            (*t1)->rollback();
-        }
-        GEOSGeom_destroy_r(hdl, line);
-        if (++lc % 5 == 0) {
-            cout << "[" << world.rank() << "] " << lc << endl;
-        }
+    if (!add_lines(t1, orphans, DEFAULT_TOLERANCE, true)) {
+        // a merged topology without its orphans must not be saved
+        cerr << "[" << world.rank() << "] (fatal) could not add the orphans of zone #"
+             << t1->zoneId() << endl;
+        world.abort(1);
     }
     auto end = chrono::steady_clock::now();
     auto elapsed = chrono::duration_cast<chrono::milliseconds>(end - start);
 
     cout << "[" << world.rank() << "] added new merged topology for"
-         << " zone #" << (*t1)->zoneId() << " (lc: " << merged_zone->count() << ") -- took: " << elapsed.count() << " ms." << endl;
-    (*t1)->print_stats();
+         << " zone #" << t1->zoneId() << " (lc: " << merged_zone->count() << ") -- took: " << elapsed.count() << " ms." << endl;
+    t1->print_stats();
 
-    // orphan lines were already deleted in the above loop
-    orphans.clear();
+    // orphan lines were already deleted by add_lines()
+    assert (orphans.empty());
 
-    save_topology(geos, merged_zone, *t1);
+    t1->build_faces();
+
+    // resident topologies only reach the disk through checkpoints
+    if (!topology_store::resident()) {
+        save_topology(geos, merged_zone, t1);
+    }
 
     return orphan_count;
 }
@@ -31,6 +31,10 @@ void merge_topologies(Topology& t1, Topology& t2);
 /**
  * Proceed with a pair-wise merge and return merged topologies
  * as well as merged zones.
+ *
+ * If seam_only is set, merged topologies which need their indexes rebuilt
+ * before adding orphans only get the region covered by the orphans
+ * indexed (see Topology::rebuild_indexes(const OGREnvelope&)).
  */
 int merge_topologies(
     PG& db,
@@ -38,9 +42,53 @@ int merge_topologies(
     std::vector<zone*> zones,     // get a copy of the zones, this is not a mistake
     std::vector<int>& topologies,
     std::vector<zone*>& new_zones,
-    bool merge_restore = true
+    bool merge_restore = true,
+    bool seam_only = false
+);
+
+/**
+ * Orphans added by the merge of a group and the time it took, on its own
+ * thread.
+ */
+struct group_merge_stats
+{
+    int orphans = 0;
+    double seconds = 0.;
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int version) {
+        ar & orphans;
+        ar & seconds;
+    }
+};
+
+/**
+ * Same as merge_topologies() without the final reduction: returns the
+ * number of orphans added by this rank. Not a collective operation.
+ *
+ * Groups are independent and merged by up to set_merge_threads() threads,
+ * each with its own GEOS context and PostgreSQL connection. If stats is
+ * given, it receives the stats of each group, in order.
+ */
+int merge_groups(
+    PG& db,
+    GEOSHelper* geos,
+    std::vector<zone*> zones,
+    std::vector<int>& topologies,
+    std::vector<zone*>& new_zones,
+    bool merge_restore = true,
+    bool seam_only = false,
+    std::vector<group_merge_stats>* stats = nullptr
 );
 
+/**
+ * Number of threads merging the groups given to merge_groups() at once
+ * (default: 1). MPI must be initialized with MPI_THREAD_MULTIPLE.
+ */
+void set_merge_threads(int threads);
+
+int merge_thread_count();
+
 /**
  * Get the next 4-grouped zones that can be merged.
  */
@@ -61,14 +109,19 @@ double height(const OGREnvelope& envelope);
 
 direction_type position(const OGREnvelope& e1, const OGREnvelope& e2);
 
+/**
+ * Merge the 4 topologies of a group into the first one, then add the
+ * lines contained in the merged zone but in none of the original zones. The other topologies are deleted and topologies[0] may be
+ * replaced by a restored checkpoint.
+ */
 int _internal_merge(
     PG& db,
     GEOSHelper* geos,
     std::vector<zone*>& zones,
-    Topology** t1,
-    Topology* t2,
+    std::vector<Topology*>& topologies,
     std::vector<zone*>& new_zones,
-    bool merge_restore);
+    bool merge_restore,
+    bool seam_only = false);
 
 } // namespace cma
 
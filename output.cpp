@@ -0,0 +1,277 @@
+#include <output.h>
+
+#include <map>
+#include <chrono>
+#include <algorithm>
+#include <cassert>
+#include <fstream>
+#include <iostream>
+
+#include <mpi.h>
+#include <boost/mpi/operations.hpp>
+#include <boost/mpi/collectives.hpp>
+#include <boost/mpi/communicator.hpp>
+
+#include <st.h>
+#include <build.h>
+#include <fixed.h>
+#include <store.h>
+#include <catalog.h>
+#include <topology.h>
+
+using namespace std;
+using namespace boost::mpi;
+
+namespace cma {
+
+static void add_counts(id_offsets& lhs, const id_offsets& rhs)
+{
+    lhs.node += rhs.node;
+    lhs.edge += rhs.edge;
+    lhs.face += rhs.face;
+    lhs.topogeo += rhs.topogeo;
+}
+
+/**
+ * Cut prescreened lines along an envelope: the part of each line within it
+ * (dropping single points where it only touches it), noded on the grid in
+ * fixed grid mode. Returns false if GEOS fails.
+ */
+static bool cut_lines(const OGREnvelope& envelope, const linesV& lines, linesV& pieces)
+{
+    GEOSGeometry* area = OGREnvelope2GEOSGeom(envelope);
+
+    bool complete = true;
+    for (const pair<int, GEOSGeometry*>& line : lines) {
+        vector<double> bbox;
+        if (!bounding_box(line.second, bbox) ||
+            bbox[2] < envelope.MinX || bbox[0] > envelope.MaxX ||
+            bbox[3] < envelope.MinY || bbox[1] > envelope.MaxY) {
+            continue;
+        }
+
+        GEOSGeometry* cut = GEOSIntersection_r(hdl, line.second, area);
+        if (!cut) {
+            complete = false;
+            break;
+        }
+
+        vector<GEOSGeometry*> parts;
+        for (int i = 0; i < GEOSGetNumGeometries_r(hdl, cut); ++i) {
+            const GEOSGeometry* part = GEOSGetGeometryN_r(hdl, cut, i);
+            if (GEOSGeomTypeId_r(hdl, part) == GEOS_LINESTRING && GEOSisEmpty_r(hdl, part) == 0) {
+                parts.push_back(GEOSGeom_clone_r(hdl, part));
+            }
+        }
+        GEOSGeom_destroy_r(hdl, cut);
+        if (parts.empty()) {
+            continue;
+        }
+
+        GEOSGeometry* piece = parts.size() == 1 ? parts[0] :
+            GEOSGeom_createCollection_r(hdl, GEOS_MULTILINESTRING, parts.data(), parts.size());
+
+        // the cut points are off the grid
+        if (fixed_grid()) {
+            GEOSGeometry* noded = node_on_grid(piece);
+            GEOSGeom_destroy_r(hdl, piece);
+            if (!noded) {
+                complete = false;
+                break;
+            }
+            if (GEOSisEmpty_r(hdl, noded) == 1) {
+                GEOSGeom_destroy_r(hdl, noded);
+                continue;
+            }
+            piece = noded;
+        }
+
+        GEOSSetSRID_r(hdl, piece, GEOSGetSRID_r(hdl, line.second));
+        pieces.push_back(make_pair(line.first, piece));
+    }
+
+    GEOSGeom_destroy_r(hdl, area);
+    return complete;
+}
+
+void write_partitions(
+    PG& db,
+    GEOSHelper* geos,
+    const vector<zone*>& zones,
+    const vector<int>& seam_lines)
+{
+    communicator world;
+
+    auto start = chrono::steady_clock::now();
+
+    // resident partitions go to their writing rank first
+    if (topology_store::resident()) {
+        vector< pair<int, int> > moves;
+        for (int i = 0; i < zones.size(); ++i) {
+            moves.push_back(make_pair(zones[i]->id(), i % world.size()));
+        }
+        topology_store::instance().transfer(geos, moves);
+    }
+
+    // seam lines, self-noded once for all the partitions of this rank
+    linesV lines;
+    if (!seam_lines.empty() && world.rank() < zones.size()) {
+        if (!db.get_lines(seam_lines, lines)) {
+            cerr << "[" << world.rank() << "] (fatal) could not fetch the seam lines" << endl;
+            world.abort(1);
+        }
+        prescreen_lines(lines);
+    }
+
+    // partition holding the first piece of each seam line, zones.size() if none
+    vector<int> first_piece(seam_lines.size(), zones.size());
+    size_t piece_count = 0;
+
+    vector<Topology*> topologies;
+    id_offsets local;
+    for (int i = world.rank(); i < zones.size(); i += world.size()) {
+        Topology* t = topology_store::instance().fetch(geos, zones[i]);
+        if (!t) {
+            cerr << "[" << world.rank() << "] missing topology for partition #" << zones[i]->id() << endl;
+            t = new Topology(geos);
+        }
+
+        linesV pieces;
+        if (!cut_lines(zones[i]->envelope(), lines, pieces)) {
+            cerr << "[" << world.rank() << "] (fatal) could not cut the seam lines along partition #"
+                 << zones[i]->id() << endl;
+            world.abort(1);
+        }
+
+        if (!pieces.empty()) {
+            for (const pair<int, GEOSGeometry*>& piece : pieces) {
+                int k = lower_bound(seam_lines.begin(), seam_lines.end(), piece.first) - seam_lines.begin();
+                first_piece[k] = min(first_piece[k], i);
+            }
+            piece_count += pieces.size();
+
+            if (!t->indexed()) {
+                t->rebuild_indexes();
+            }
+            // a partition without its seam pieces must not be written
+            if (!add_lines(t, pieces, DEFAULT_TOLERANCE, true)) {
+                cerr << "[" << world.rank() << "] (fatal) could not add the seam lines of partition #"
+                     << zones[i]->id() << endl;
+                world.abort(1);
+            }
+            t->build_faces();
+        }
+
+        add_counts(local, t->id_counts());
+        topologies.push_back(t);
+    }
+
+    for (pair<int, GEOSGeometry*>& line : lines) {
+        GEOSGeom_destroy_r(hdl, line.second);
+    }
+    lines.clear();
+
+    // ids written by the lower ranks
+    int64_t counts[4] = { local.node, local.edge, local.face, local.topogeo };
+    int64_t before[4] = { 0, 0, 0, 0 };
+    MPI_Exscan(counts, before, 4, MPI_LONG_LONG, MPI_SUM, world);
+    if (world.rank() == 0) {
+        // MPI_Exscan leaves the receive buffer of rank 0 undefined
+        fill(begin(before), end(before), 0);
+    }
+
+    // seam lines take the topogeo ids following those of every partition
+    int64_t partition_topogeo = 0;
+    all_reduce(world, local.topogeo, partition_topogeo, std::plus<int64_t>());
+
+    vector<int> owners(seam_lines.size(), zones.size());
+    if (!seam_lines.empty()) {
+        all_reduce(world, first_piece.data(), first_piece.size(), owners.data(), minimum<int>());
+    }
+
+    map<int, int64_t> shared;
+    for (int k = 0; k < seam_lines.size(); ++k) {
+        if (owners[k] < zones.size()) {
+            shared[seam_lines[k]] = partition_topogeo + 1 + k;
+        }
+    }
+
+    id_offsets offsets;
+    offsets.node = before[0];
+    offsets.edge = before[1];
+    offsets.face = before[2];
+    offsets.topogeo = before[3];
+
+    const string suffix = "-" + to_string(world.rank());
+    for (int i = 0; i < topologies.size(); ++i) {
+        topologies[i]->pg_output(suffix, offsets, i > 0, shared);
+        add_counts(offsets, topologies[i]->id_counts());
+        delete topologies[i];
+    }
+    if (topologies.empty()) {
+        // an empty slice still tells the loader this rank is done
+        Topology().pg_output(suffix, offsets);
+    }
+
+    // each seam line is written by the rank of its first piece
+    ofstream ofs("topo_geom" + suffix + ".sql", ios::out | ios::app);
+    assert (ofs.is_open());
+    for (int k = 0; k < seam_lines.size(); ++k) {
+        if (owners[k] < zones.size() && owners[k] % world.size() == world.rank()) {
+            Topology::pg_topo_geom(ofs, seam_lines[k], shared[seam_lines[k]]);
+        }
+    }
+    ofs.close();
+
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+    cout << "[" << world.rank() << "] wrote " << topologies.size() << " partitions (" << local.node
+         << " nodes, " << local.edge << " edges, " << local.face << " faces from id offsets "
+         << before[0] << "/" << before[1] << "/" << before[2] << ", " << piece_count
+         << " seam line pieces, took: " << elapsed.count() << " ms)" << endl;
+}
+
+bool get_seam_lines(
+    PG& db,
+    const vector<zone*>& zones,
+    const vector<depth_group_t>& groups,
+    vector<int>& ids)
+{
+    map<int, OGREnvelope> envelopes;
+    for (const zone* z : zones) {
+        envelopes[z->id()] = z->envelope();
+    }
+
+    for (const depth_group_t& g : groups) {
+        vector<OGREnvelope> children;
+        for (int zoneId : g.second) {
+            children.push_back(envelopes.at(zoneId));
+        }
+
+        OGREnvelope merged = children[0];
+        for (int i = 1; i < children.size(); ++i) {
+            merged.Merge(children[i]);
+        }
+        envelopes[g.second[0]] = merged;
+
+        vector<int> group_ids;
+        if (!line_catalog::instance().is_open() || !line_catalog::instance().lines(merged, group_ids)) {
+            linesV lines;
+            if (!db.get_group_lines(children, lines)) {
+                return false;
+            }
+            for (const auto& p : lines) {
+                group_ids.push_back(p.first);
+                GEOSGeom_destroy_r(hdl, p.second);
+            }
+        }
+        ids.insert(ids.end(), group_ids.begin(), group_ids.end());
+    }
+
+    sort(ids.begin(), ids.end());
+    ids.erase(unique(ids.begin(), ids.end()), ids.end());
+
+    cout << ids.size() << " seam lines to cut along the partitions" << endl;
+    return true;
+}
+
+} // namespace cma
@@ -0,0 +1,56 @@
+#ifndef __CMA_OUTPUT_H
+#define __CMA_OUTPUT_H
+
+#include <string>
+#include <vector>
+
+#include <pg.h>
+#include <types.h>
+#include <zones.h>
+
+namespace cma {
+
+/**
+ * Write the topologies of the zones left after the merge (the partitions)
+ * and the seam lines (see get_seam_lines()) without bringing them to a
+ * single rank.
+ *
+ * Partition i (in zones order) is written by rank i % size to
+ * node-<rank>.csv, edge_data-<rank>.csv, face-<rank>.csv,
+ * relation-<rank>.csv and topo_geom-<rank>.sql. Seam lines are cut along
+ * the partition borders first and each piece is added to the partition it
+ * lies in. Node, edge, face and topogeo ids are made globally unique by
+ * offsetting them with the id counts of all the partitions written
+ * before, computed with an exclusive prefix sum over the ranks. The pieces
+ * of a seam line share a topogeo id following those of the partitions,
+ * and its topo_geom statement is written once.
+ *
+ * Partitions do not share edges or faces. A point of a partition border
+ * where lines of several partitions end (or a seam line is cut) has a node
+ * in each of them, as merge_topologies() leaves it at zone borders, so no
+ * reference crosses a partition and none has to be remapped.
+ *
+ * This is a collective operation, zones and seam_lines must be the same on
+ * every rank.
+ */
+void write_partitions(
+    PG& db,
+    GEOSHelper* geos,
+    const std::vector<zone*>& zones,
+    const std::vector<int>& seam_lines);
+
+/**
+ * Get the ids (sorted) of the lines the merge of groups (ordered by depth,
+ * deepest first) would have added as orphans, i.e. the lines in none of
+ * the partitions. zones are the zones groups start from. Lines come from
+ * the line catalog when it is open.
+ */
+bool get_seam_lines(
+    PG& db,
+    const std::vector<zone*>& zones,
+    const std::vector<depth_group_t>& groups,
+    std::vector<int>& ids);
+
+} // namespace cma
+
+#endif // __CMA_OUTPUT_H
@@ -1,6 +1,8 @@
 #include <pg.h>
 
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <cassert>
 #include <sstream>
 #include <iostream>
@@ -14,13 +16,10 @@ using namespace std;
 
 using namespace boost::algorithm;
 
-namespace cma {
-    extern GEOSContextHandle_t hdl;
-}
-
 namespace cma {
 
 PG::PG(const string& connect_str)
+: _connect_str(connect_str)
 {
     _conn = PQconnectdb(connect_str.c_str());
 }
@@ -83,6 +82,27 @@ int PG::get_line_count()
     return count;
 }
 
+int PG::get_line_count(const OGREnvelope& envelope)
+{
+    GEOSGeometry* g = OGREnvelope2GEOSGeom(envelope);
+    string pg_geom = build_pg_geom(g);
+    GEOSGeom_destroy_r(hdl, g);
+
+    ostringstream oss;
+    oss << "SELECT count(1) FROM way WHERE "
+        << pg_geom << " && line2d_m AND ST_Contains(" << pg_geom << ", line2d_m)";
+
+    PGresult* res = query(oss.str().c_str());
+    if (!success(res)) {
+        PQclear(res);
+        return -1;
+    }
+
+    int count = atoi(PQgetvalue(res, 0, 0));
+    PQclear(res);
+    return count;
+}
+
 GEOSGeometry* PG::get_line(int id)
 {
     ostringstream oss;
@@ -190,6 +210,56 @@ bool PG::get_common_lines(
     GEOSGeom_destroy_r(hdl, g3);
 }
 
+bool PG::get_group_lines(
+    const vector<OGREnvelope>& envelopes,
+    linesV& lines,
+    int limit)
+{
+    assert (!envelopes.empty());
+
+    OGREnvelope m = envelopes[0];
+    for (const OGREnvelope& env : envelopes) {
+        m.Merge(env);
+    }
+
+    GEOSGeometry* g = OGREnvelope2GEOSGeom(m);
+    string m_str = build_pg_geom(g);
+    GEOSGeom_destroy_r(hdl, g);
+
+    ostringstream oss;
+    oss << "SELECT id, line2d_m FROM way WHERE "
+        << m_str << " && line2d_m AND ST_Contains(" << m_str << ", line2d_m)";
+    for (const OGREnvelope& env : envelopes) {
+        g = OGREnvelope2GEOSGeom(env);
+        oss << " AND NOT ST_Contains(" << build_pg_geom(g) << ", line2d_m)";
+        GEOSGeom_destroy_r(hdl, g);
+    }
+    if (limit > 0) oss << " LIMIT " << limit;
+
+    PGresult* res = query(oss.str().c_str());
+
+    if (!success(res)) {
+        PQclear(res);
+        return false;
+    }
+
+    char* id;
+    char* line2d;
+    GEOSWKBReader* wkb_reader = GEOSWKBReader_create_r(hdl);
+    for (int i = 0; i < PQntuples(res); i++) {
+        id = PQgetvalue(res, i, 0);
+        line2d = PQgetvalue(res, i, 1);
+        GEOSGeometry* line = GEOSWKBReader_readHEX_r(hdl, wkb_reader, (const unsigned char*)line2d, PQgetlength(res, i, 1));
+        assert (line != NULL);
+        lines.push_back(make_pair(atoi(id), line));
+    }
+    GEOSWKBReader_destroy_r(hdl, wkb_reader);
+
+    PQclear(res);
+
+    return true;
+}
+
 bool PG::get_line_ids(
     const GEOSGeometry* envelope,
     set<int>& line_ids,
@@ -249,6 +319,76 @@ bool PG::get_lines(const std::set<int> lineIds, linesV& lines)
     return true;
 }
 
+bool PG::get_lines(const vector<int>& lineIds, linesV& lines)
+{
+    const size_t chunk = 10000;
+
+    for (size_t first = 0; first < lineIds.size(); first += chunk) {
+        size_t last = min(first + chunk, lineIds.size());
+
+        vector<string> ids;
+        transform(lineIds.begin() + first, lineIds.begin() + last, back_inserter(ids), [](int a) {
+            return to_string(a);
+        });
+
+        ostringstream oss;
+        oss << "SELECT id, line2d_m FROM way WHERE id IN (" << join(ids, ",") << ") ORDER BY id";
+
+        PGresult* res = query(oss.str().c_str());
+
+        if (!success(res)) {
+            PQclear(res);
+            return false;
+        }
+
+        char* id;
+        char* line2d;
+        GEOSWKBReader* wkb_reader = GEOSWKBReader_create_r(hdl);
+        for (int i = 0; i < PQntuples(res); i++) {
+            id = PQgetvalue(res, i, 0);
+            line2d = PQgetvalue(res, i, 1);
+            GEOSGeometry* line = GEOSWKBReader_readHEX_r(hdl, wkb_reader, (const unsigned char*)line2d, PQgetlength(res, i, 1));
+            if (line != NULL) {
+                lines.push_back(make_pair(atoi(id), line));
+            }
+            else {
+                cerr << "Line id " << id << " could not be converted to a GEOSGeometry..." << endl;
+            }
+        }
+        GEOSWKBReader_destroy_r(hdl, wkb_reader);
+
+        PQclear(res);
+    }
+
+    return true;
+}
+
+bool PG::for_each_line_box(const function<void(int, const double*)>& f)
+{
+    PGresult* res = query(
+        "SELECT id, ST_XMin(line2d_m), ST_YMin(line2d_m), ST_XMax(line2d_m), ST_YMax(line2d_m) FROM way",
+        true);
+
+    bool ok = true;
+    double box[4];
+    for (; res; res = next_result()) {
+        int status = PQresultStatus(res);
+        if (status == PGRES_SINGLE_TUPLE && !PQgetisnull(res, 0, 1)) {
+            for (int i = 0; i < 4; ++i) {
+                box[i] = atof(PQgetvalue(res, 0, i+1));
+            }
+            f(atoi(PQgetvalue(res, 0, 0)), box);
+        }
+        else if (status != PGRES_SINGLE_TUPLE && status != PGRES_TUPLES_OK) {
+            cerr << PQresultErrorMessage(res) << endl;
+            ok = false;
+        }
+        PQclear(res);
+    }
+
+    return ok;
+}
+
 string PG::_build_query(
     const GEOSGeometry* geom,
     bool within,
@@ -2,6 +2,8 @@
 #define __CMA_PG_H
 
 #include <string>
+#include <functional>
+#include <vector>
 #include <libpq-fe.h>
 #include <ogrsf_frmts.h>
 
@@ -16,11 +18,20 @@ public:
     ~PG();
 
     bool connected() const;
+
+    const std::string& connect_str() const {
+        return _connect_str;
+    }
     PGresult* query(const std::string& sql, bool single_row_mode=false);
     PGresult* next_result();
     bool success(PGresult* res) const;
     int get_line_count();
 
+    /**
+     * Number of lines contained in the envelope, -1 on error.
+     */
+    int get_line_count(const OGREnvelope& envelope);
+
     /**
      * Below are some geometry helpers.
      */
@@ -38,6 +49,15 @@ public:
         linesV& lines,
         int limit=-1);
 
+    /**
+     * Lines contained in the envelope of a group of zones but in none of
+     * them, i.e. all the orphans of the group in a single query.
+     */
+    bool get_group_lines(
+        const std::vector<OGREnvelope>& envelopes,
+        linesV& lines,
+        int limit=-1);
+
     bool get_line_ids(
         const GEOSGeometry* envelope,
         std::set<int>& line_ids,
@@ -48,6 +68,21 @@ public:
         const std::set<int> lineIds,
         linesV& lines);
 
+    /**
+     * Fetch lines by id (sorted), ordered by id. Large lists are split
+     * into several queries.
+     */
+    bool get_lines(
+        const std::vector<int>& lineIds,
+        linesV& lines);
+
+    /**
+     * Stream the bounding box (minx, miny, maxx, maxy) of every line in
+     * single-row mode.
+     */
+    bool for_each_line_box(
+        const std::function<void(int, const double*)>& f);
+
     std::string build_pg_geom(const GEOSGeometry* geom) const;
 
 private:
@@ -56,6 +91,7 @@ private:
         bool within,
         int limit);
 
+    std::string _connect_str;
     PGconn* _conn = NULL;
 };
 
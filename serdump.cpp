@@ -9,10 +9,6 @@
 using namespace cma;
 using namespace std;
 
-namespace cma {
-    GEOSContextHandle_t hdl;
-}
-
 int main(int argc, char** argv)
 {
     if (argc != 2) {
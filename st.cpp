@@ -2,6 +2,7 @@
 
 #include <cmath>
 #include <string>
+#include <mutex>
 #include <vector>
 #include <cassert>
 #include <iostream>
@@ -16,10 +17,67 @@ using namespace std;
 
 namespace cma {
 
+/**
+ * liblwgeom goes through the global (non-reentrant) GEOS context of
+ * initGEOS(), which it may initialize again, and reports errors in the
+ * global lwgeom_geos_errmsg: every function calling it holds this lock.
+ */
+static mutex lwgeom_mutex;
+
 const float DIST_MIN = 1.;
 
+/**
+ * Get the coordinates of a point or linestring as x1, y1, x2, y2, ...
+ */
+void _xy_coordinates(const GEOSGeometry* geom, vector<double>& coords)
+{
+    const GEOSCoordSequence* seq = GEOSGeom_getCoordSeq_r(hdl, geom);
+    unsigned int size;
+    GEOSCoordSeq_getSize_r(hdl, seq, &size);
+
+    coords.resize(size*2);
+    for (unsigned int i = 0; i < size; ++i) {
+        GEOSCoordSeq_getX_r(hdl, seq, i, &coords[i*2]);
+        GEOSCoordSeq_getY_r(hdl, seq, i, &coords[i*2+1]);
+    }
+}
+
 bool ST_Equals(const GEOSGeom g1, const GEOSGeom g2)
 {
+    int type = GEOSGeomTypeId_r(hdl, g1);
+    if ((type == GEOS_POINT || type == GEOS_LINESTRING) && type == GEOSGeomTypeId_r(hdl, g2)) {
+        // Exact fast paths: geometries with different envelopes cannot be
+        // equal while identical coordinates (in either direction) always are.
+        // This is what most tests end up with on a fixed grid.
+        vector<double> c1, c2;
+        _xy_coordinates(g1, c1);
+        _xy_coordinates(g2, c2);
+
+        if (!c1.empty() && !c2.empty()) {
+            if (c1 == c2) {
+                return true;
+            }
+
+            vector<double> bbox1, bbox2;
+            bounding_box(g1, bbox1);
+            bounding_box(g2, bbox2);
+            if (bbox1 != bbox2) {
+                return false;
+            }
+
+            if (c1.size() == c2.size()) {
+                bool reversed = true;
+                size_t n = c1.size() / 2;
+                for (size_t i = 0; reversed && i < n; ++i) {
+                    reversed = c1[i*2] == c2[(n-1-i)*2] && c1[i*2+1] == c2[(n-1-i)*2+1];
+                }
+                if (reversed) {
+                    return true;
+                }
+            }
+        }
+    }
+
     return GEOSWithin_r(hdl, g1, g2) == 1 && GEOSWithin_r(hdl, g2, g1) == 1;
 }
 
@@ -88,6 +146,8 @@ double ST_Y(const GEOSGeom geom)
  */
 double ST_Azimuth(const GEOSGeometry* g1, const GEOSGeometry* g2)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     assert (g1 && GEOSGeomTypeId_r(hdl, g1) == GEOS_POINT);
     assert (g2 && GEOSGeomTypeId_r(hdl, g2) == GEOS_POINT);
 
@@ -123,6 +183,8 @@ double ST_Azimuth(const GEOSGeometry* g1, const GEOSGeometry* g2)
  */
 double ST_Distance(const GEOSGeometry* g1, const GEOSGeometry* g2)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     LWGEOM* lwgeom1 = GEOS2LWGEOM(g1, 0);
     LWGEOM* lwgeom2 = GEOS2LWGEOM(g2, 0);
 
@@ -174,6 +236,8 @@ GEOSGeom ST_Snap(const GEOSGeom g1, const GEOSGeom g2, double tolerance)
  */
 GEOSGeom ST_Split(const GEOSGeometry* in, const GEOSGeometry* blade_in)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     LWGEOM* lwgeom_in  = GEOS2LWGEOM(in, 0);
     LWGEOM* lwblade_in = GEOS2LWGEOM(blade_in, 0);
     LWGEOM* lwgeom_out;
@@ -212,6 +276,8 @@ GEOSGeom ST_Collect(GEOSGeometry* g1, GEOSGeometry* g2)
  */
 GEOSGeometry* ST_Reverse(const GEOSGeometry* geom)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     LWGEOM* lwgeom = GEOS2LWGEOM(geom, 0);
     lwgeom_reverse(lwgeom);
     GEOSGeom ret = LWGEOM2GEOS(lwgeom);
@@ -221,6 +287,8 @@ GEOSGeometry* ST_Reverse(const GEOSGeometry* geom)
 
 GEOSGeom ST_AddPoint(GEOSGeometry* line, GEOSGeometry* point, int where)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     assert (line);
     assert (point);
     assert (GEOSGeomTypeId_r(hdl, line) == GEOS_LINESTRING);
@@ -257,6 +325,8 @@ GEOSGeom ST_EndPoint(const GEOSGeometry* geom)
 
 GEOSGeom ST_Envelope(const GEOSGeom geom)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     if (!geom) {
         return nullptr;
     }
@@ -317,6 +387,8 @@ GEOSGeom ST_Envelope(const GEOSGeom geom)
  */
 GEOSGeom ST_ForceRHR(const GEOSGeom geom)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     LWGEOM *lwgeom = GEOS2LWGEOM(geom, 0);
 
     lwgeom_force_clockwise(lwgeom);
@@ -343,6 +415,8 @@ GEOSGeom ST_MakeLine(const GEOSGeom g1, const GEOSGeom g2)
 
 GEOSGeometry* ST_MakeLine(const std::vector<const GEOSGeometry*>& geometries)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     assert (geometries.size() > 0);
 
     LWGEOM** lwgeoms = new LWGEOM*[geometries.size()];
@@ -373,6 +447,8 @@ GEOSGeometry* ST_MakeLine(const std::vector<const GEOSGeometry*>& geometries)
  */
 GEOSGeom ST_SetPoint(const GEOSGeometry* line, int index, const GEOSGeometry* point)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     // index is 0-based in PostGIS
     assert (line && GEOSGeomTypeId_r(hdl, line) == GEOS_LINESTRING);
     assert (index >= 0 && index < GEOSGeomGetNumPoints_r(hdl, line));
@@ -403,6 +479,8 @@ GEOSGeom ST_SetPoint(const GEOSGeometry* line, int index, const GEOSGeometry* po
  */
 GEOSGeometry* ST_BuildArea(const GEOSGeometry* geom)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     GEOSGeometry* ret = nullptr;
 
     if (GEOSisEmpty_r(hdl, geom) == 1) {
@@ -427,6 +505,8 @@ GEOSGeometry* ST_BuildArea(const GEOSGeometry* geom)
  */
 GEOSGeom ST_GeometryN(const GEOSGeom geom, int index)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     if (index < 0) {
         return NULL;
     }
@@ -459,6 +539,8 @@ GEOSGeom ST_GeometryN(const GEOSGeom geom, int index)
  */
 GEOSGeom ST_MakeValid(const GEOSGeometry* geom)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     LWGEOM* lwgeom_in = GEOS2LWGEOM(geom, 0);
     LWGEOM* lwgeom_out = lwgeom_make_valid(lwgeom_in);
 
@@ -487,6 +569,8 @@ GEOSGeom ST_StartPoint(const GEOSGeometry* geom)
  */
 GEOSGeom ST_MakePolygon(const GEOSGeom geom)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     const LWLINE* shell = lwgeom_as_lwline(GEOS2LWGEOM(geom, 0));
     LWPOLY* outpoly = lwpoly_from_lwlines(shell, 0, NULL);
 
@@ -569,6 +653,8 @@ GEOSGeometry* ST_CollectionExtract(GEOSGeometry* geom, int type)
  */
 GEOSGeom ST_RemoveRepeatedPoints(const GEOSGeom geom)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     LWGEOM* lwgeom = GEOS2LWGEOM(geom, 0);
     LWGEOM* outgeom = lwgeom_remove_repeated_points(lwgeom);
 
@@ -637,12 +723,105 @@ GEOSGeometry* ST_LineInterpolatePoint(const GEOSGeometry* geom, double distance)
     return GEOSGeomGetEndPoint_r(hdl, geom);
 }
 
+void line_interpolate_point(
+    const vector<double>& xs,
+    const vector<double>& ys,
+    double distance,
+    double& x,
+    double& y)
+{
+    assert (distance >= 0. && distance <= 1.);
+    assert (xs.size() == ys.size() && xs.size() >= 2);
+
+    int nsegs = xs.size() - 1;
+
+    if (distance == 0.) {
+        x = xs[0];
+        y = ys[0];
+        return;
+    }
+    if (distance == 1.) {
+        x = xs[nsegs];
+        y = ys[nsegs];
+        return;
+    }
+
+    double length = 0., tlength = 0.;
+    for (int i = 0; i < nsegs; ++i) {
+        length += sqrt((xs[i+1]-xs[i])*(xs[i+1]-xs[i]) + (ys[i+1]-ys[i])*(ys[i+1]-ys[i]));
+    }
+
+    for (int i = 0; i < nsegs; ++i) {
+        double slength = sqrt((xs[i+1]-xs[i])*(xs[i+1]-xs[i]) + (ys[i+1]-ys[i])*(ys[i+1]-ys[i]));
+        slength /= length;
+
+        if (distance < tlength + slength) {
+            double dseg = (distance - tlength) / slength;
+            x = xs[i] + ((xs[i+1]-xs[i])*dseg);
+            y = ys[i] + ((ys[i+1]-ys[i])*dseg);
+            return;
+        }
+
+        tlength += slength;
+    }
+
+    x = xs[nsegs];
+    y = ys[nsegs];
+}
+
+void points_in_ring(
+    const vector<double>& rx,
+    const vector<double>& ry,
+    const vector<double>& px,
+    const vector<double>& py,
+    vector<char>& inside)
+{
+    assert (rx.size() == ry.size());
+    assert (px.size() == py.size());
+
+    size_t count = px.size();
+    vector<char> crossings(count, 0);
+    vector<char> boundary(count, 0);
+
+    const double* pxs = px.data();
+    const double* pys = py.data();
+    char* cs = crossings.data();
+    char* bs = boundary.data();
+
+    for (size_t s = 0; s + 1 < rx.size(); ++s) {
+        double x1 = rx[s], y1 = ry[s];
+        double x2 = rx[s+1], y2 = ry[s+1];
+        double minx = min(x1, x2), maxx = max(x1, x2);
+        double miny = min(y1, y2), maxy = max(y1, y2);
+        bool upward = y2 > y1;
+
+        // branch free so that it vectorizes
+        #pragma omp simd
+        for (size_t i = 0; i < count; ++i) {
+            double cross = (x2 - x1) * (pys[i] - y1) - (pxs[i] - x1) * (y2 - y1);
+            bool straddles = (y1 > pys[i]) != (y2 > pys[i]);
+
+            // the ray going to +x crosses the segment
+            cs[i] ^= straddles & ((cross > 0.) == upward);
+            bs[i] |= (cross == 0.) & (pxs[i] >= minx) & (pxs[i] <= maxx)
+                                   & (pys[i] >= miny) & (pys[i] <= maxy);
+        }
+    }
+
+    inside.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        inside[i] = cs[i] && !bs[i];
+    }
+}
+
 /**
  * Mostly equivalent to the following function (postgis/lwgeom_ogc.c):
  *   Datum LWGEOM_numpoints_linestring(PG_FUNCTION_ARGS)
  */
 int ST_NPoints(const GEOSGeometry* geom)
 {
+    lock_guard<mutex> lock(lwgeom_mutex);
+
     LWGEOM* lwgeom = GEOS2LWGEOM(geom, 0);
 
     int ret = lwgeom_count_vertices(lwgeom);
@@ -656,7 +835,35 @@ bool bounding_box(const GEOSGeom geom, vector<double>& bbox)
 {
     assert (bbox.size() == 0);
 
-    const GEOSCoordSequence* seq = GEOSGeom_getCoordSeq_r(hdl, geom);
+    if (is_collection(geom)) {
+        for (int i = 0; i < GEOSGetNumGeometries_r(hdl, geom); ++i) {
+            vector<double> part;
+            if (!bounding_box(const_cast<GEOSGeometry*>(GEOSGetGeometryN_r(hdl, geom, i)), part)) {
+                continue;
+            }
+
+            if (bbox.empty()) {
+                bbox = part;
+            }
+            else {
+                bbox[0] = min(bbox[0], part[0]);
+                bbox[1] = min(bbox[1], part[1]);
+                bbox[2] = max(bbox[2], part[2]);
+                bbox[3] = max(bbox[3], part[3]);
+            }
+        }
+        return !bbox.empty();
+    }
+
+    const GEOSGeometry* g = geom;
+    if (GEOSGeomTypeId_r(hdl, g) == GEOS_POLYGON) {
+        if (GEOSisEmpty_r(hdl, g) == 1) {
+            return false;
+        }
+        g = GEOSGetExteriorRing_r(hdl, g);
+    }
+
+    const GEOSCoordSequence* seq = GEOSGeom_getCoordSeq_r(hdl, g);
     unsigned int size;
     GEOSCoordSeq_getSize_r(hdl, seq, &size);
 
@@ -9,8 +9,6 @@
 
 namespace cma {
 
-extern GEOSContextHandle_t hdl;
-
 /**
  * Port of some PostGIS/topology functions.
  */
@@ -52,6 +50,29 @@ GEOSGeometry* ST_LineInterpolatePoint(const GEOSGeometry* geom, double distane);
 int ST_NPoints(const GEOSGeometry* geom);
 
 bool bounding_box(const GEOSGeom geom, std::vector<double>& bbox);
+
+/**
+ * ST_LineInterpolatePoint() on the coordinates of a linestring.
+ */
+void line_interpolate_point(
+    const std::vector<double>& xs,
+    const std::vector<double>& ys,
+    double distance,
+    double& x,
+    double& y);
+
+/**
+ * Batched ST_Contains(ring polygon, point) for many points: inside[i] is set
+ * if (px[i], py[i]) is strictly inside the closed ring (rx, ry), points on
+ * its boundary are not contained. One crossing number pass over the ring
+ * segments updates all points at once.
+ */
+void points_in_ring(
+    const std::vector<double>& rx,
+    const std::vector<double>& ry,
+    const std::vector<double>& px,
+    const std::vector<double>& py,
+    std::vector<char>& inside);
 bool is_collection(const GEOSGeometry* geom);
 
 } // namespace cma
@@ -0,0 +1,398 @@
+#include <store.h>
+
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <sstream>
+#include <cassert>
+#include <iostream>
+
+#include <boost/mpi/operations.hpp>
+#include <boost/mpi/collectives.hpp>
+#include <boost/mpi/nonblocking.hpp>
+#include <boost/mpi/communicator.hpp>
+#include <boost/serialization/map.hpp>
+#include <boost/serialization/string.hpp>
+
+#include <zones.h>
+
+using namespace std;
+using namespace boost::mpi;
+
+namespace cma {
+
+/**
+ * Tags of the messages carrying topology sizes and chunks. Messages between
+ * two ranks are not overtaking, and the two ranks of a move agree on their
+ * order (transfer() is collective, send() and receive() are told by rank
+ * 0), so moves are matched by their order.
+ */
+const int topology_tag = 1;
+const int chunk_tag = 4;
+
+/**
+ * Largest message, MPI counts are ints.
+ */
+const uint64_t chunk_size = uint64_t(1) << 30;
+
+bool topology_store::s_resident = false;
+size_t topology_store::s_budget = 0;
+int topology_store::s_checkpoint_interval = 4;
+
+static string serialize_topology(const zone* z, bool saved, const Topology* t)
+{
+    ostringstream oss;
+    {
+        boost::archive::binary_oarchive oa(oss, boost::archive::no_header);
+        oa << *z;
+        oa << saved;
+        oa << *t;
+    }
+    return oss.str();
+}
+
+static Topology* deserialize_topology(GEOSHelper* geos, const string& buffer, zone& z, bool& saved)
+{
+    Topology* t = new Topology(geos);
+    istringstream iss(buffer);
+    boost::archive::binary_iarchive ia(iss, boost::archive::no_header);
+    ia >> z;
+    ia >> saved;
+    ia >> *t;
+    return t;
+}
+
+topology_store::~topology_store()
+{
+    for (auto& p : _entries) {
+        delete p.second.topology;
+        delete p.second.z;
+    }
+    _entries.clear();
+    _bytes = 0;
+}
+
+topology_store& topology_store::instance()
+{
+    static topology_store store;
+    return store;
+}
+
+bool topology_store::contains(int zoneId) const
+{
+    return _entries.count(zoneId) > 0;
+}
+
+void topology_store::put(GEOSHelper* geos, zone* z, Topology* t, bool saved)
+{
+    assert (z && t);
+    assert (z->id() == t->zoneId());
+
+    size_t bytes = t->memory_bytes();
+
+    #pragma omp critical(topology_store)
+    {
+        auto it = _entries.find(z->id());
+        if (it != _entries.end()) {
+            if (it->second.topology != t) {
+                delete it->second.topology;
+            }
+            delete it->second.z;
+            _bytes -= it->second.bytes;
+            _entries.erase(it);
+        }
+
+        _entries[z->id()] = entry { new zone(z->id(), z->envelope()), t, saved, bytes, ++_clock };
+        _bytes += bytes;
+
+        if (s_budget > 0 && _bytes > s_budget) {
+            _evict(geos, z->id());
+        }
+    }
+}
+
+void topology_store::_evict(GEOSHelper* geos, int keepId)
+{
+    // the new topology is kept even if it exceeds the budget by itself
+    while (_bytes > s_budget && _entries.size() > 1) {
+        auto oldest = _entries.end();
+        for (auto it = _entries.begin(); it != _entries.end(); ++it) {
+            if (it->first != keepId && (oldest == _entries.end() || it->second.stored < oldest->second.stored)) {
+                oldest = it;
+            }
+        }
+        assert (oldest != _entries.end());
+
+        entry& e = oldest->second;
+        if (!e.saved) {
+            save_topology(geos, e.z, e.topology);
+        }
+        delete e.topology;
+        delete e.z;
+        _bytes -= e.bytes;
+        _entries.erase(oldest);
+        ++_evictions;
+    }
+}
+
+Topology* topology_store::take(int zoneId)
+{
+    auto it = _entries.find(zoneId);
+    if (it == _entries.end()) {
+        return nullptr;
+    }
+
+    Topology* t = it->second.topology;
+    delete it->second.z;
+    _bytes -= it->second.bytes;
+    _entries.erase(it);
+    return t;
+}
+
+Topology* topology_store::fetch(GEOSHelper* geos, zone* z)
+{
+    Topology* t = nullptr;
+    Topology* outdated = nullptr;
+
+    #pragma omp critical(topology_store)
+    {
+        // a merged zone keeps the id of its first zone, whose topology may be left here
+        auto it = _entries.find(z->id());
+        if (it != _entries.end()) {
+            const OGREnvelope& a = it->second.z->envelope();
+            const OGREnvelope& b = z->envelope();
+            if (a.MinX != b.MinX || a.MinY != b.MinY || a.MaxX != b.MaxX || a.MaxY != b.MaxY) {
+                outdated = take(z->id());
+            }
+        }
+
+        t = take(z->id());
+        if (t) {
+            ++_hits;
+        }
+        else {
+            ++_misses;
+        }
+    }
+    delete outdated;
+
+    if (t) {
+        // it may have been put by another merge thread
+        t->set_geos(geos);
+        return t;
+    }
+    return restore_topology(geos, z, false);
+}
+
+void topology_store::send(int zoneId, int dest)
+{
+    communicator world;
+
+    // buffers of the completed sends can go
+    for (auto it = _sends.begin(); it != _sends.end(); ) {
+        if (test_all(it->requests.begin(), it->requests.end())) {
+            it = _sends.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    _sends.push_back(outgoing());
+    outgoing& out = _sends.back();
+
+    // an empty buffer tells dest to restore the topology from disk
+    auto it = _entries.find(zoneId);
+    if (it != _entries.end()) {
+        entry e = it->second;
+        _bytes -= e.bytes;
+        _entries.erase(it);
+
+        out.buffer = serialize_topology(e.z, e.saved, e.topology);
+        delete e.topology;
+        delete e.z;
+    }
+    out.size = out.buffer.size();
+
+    out.requests.push_back(world.isend(dest, topology_tag, out.size));
+    for (uint64_t offset = 0; offset < out.buffer.size(); offset += chunk_size) {
+        int n = min<uint64_t>(chunk_size, out.buffer.size() - offset);
+        out.requests.push_back(world.isend(dest, chunk_tag, out.buffer.data() + offset, n));
+    }
+}
+
+void topology_store::receive(GEOSHelper* geos, int source)
+{
+    communicator world;
+
+    auto start = chrono::steady_clock::now();
+
+    uint64_t size;
+    world.recv(source, topology_tag, size);
+    if (size == 0) {
+        return;
+    }
+
+    string buffer(size, '\0');
+    for (uint64_t offset = 0; offset < buffer.size(); offset += chunk_size) {
+        int n = min<uint64_t>(chunk_size, buffer.size() - offset);
+        world.recv(source, chunk_tag, &buffer[offset], n);
+    }
+
+    zone z;
+    bool saved;
+    Topology* t = deserialize_topology(geos, buffer, z, saved);
+    buffer.clear();
+    put(geos, &z, t, saved);
+
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+    cout << "[" << world.rank() << "] received topology #" << z.id() << " (" << size
+         << " bytes) from rank " << source << ", took: " << elapsed.count() << " ms" << endl;
+}
+
+void topology_store::wait_sends()
+{
+    for (outgoing& out : _sends) {
+        wait_all(out.requests.begin(), out.requests.end());
+    }
+    _sends.clear();
+}
+
+void topology_store::transfer(GEOSHelper* geos, int zoneId, int dest)
+{
+    transfer(geos, vector< pair<int, int> >(1, make_pair(zoneId, dest)));
+}
+
+void topology_store::transfer(GEOSHelper* geos, const vector< pair<int, int> >& moves)
+{
+    communicator world;
+
+    if (moves.empty()) {
+        return;
+    }
+
+    vector<int> local(moves.size());
+    vector<int> holders(moves.size());
+    for (int i = 0; i < moves.size(); ++i) {
+        local[i] = contains(moves[i].first) ? world.rank() : -1;
+    }
+    all_reduce(world, local.data(), local.size(), holders.data(), maximum<int>());
+
+    auto start = chrono::steady_clock::now();
+
+    // moves of this rank, in the same order on both sides
+    vector<int> outgoing;
+    vector<int> incoming;
+    for (int i = 0; i < moves.size(); ++i) {
+        int holder = holders[i];
+        int dest = moves[i].second;
+        if (holder < 0 || holder == dest) {
+            continue;
+        }
+        if (world.rank() == holder) {
+            outgoing.push_back(i);
+        }
+        else if (world.rank() == dest) {
+            incoming.push_back(i);
+        }
+    }
+
+    vector<string> out_buffers(outgoing.size());
+    vector<uint64_t> out_sizes(outgoing.size());
+    for (int k = 0; k < outgoing.size(); ++k) {
+        int zoneId = moves[outgoing[k]].first;
+        entry e = _entries[zoneId];
+        _bytes -= e.bytes;
+        _entries.erase(zoneId);
+
+        out_buffers[k] = serialize_topology(e.z, e.saved, e.topology);
+        out_sizes[k] = out_buffers[k].size();
+        delete e.topology;
+        delete e.z;
+    }
+
+    // sizes first, receivers then allocate their buffers
+    vector<uint64_t> in_sizes(incoming.size());
+    vector<request> requests;
+    for (int k = 0; k < outgoing.size(); ++k) {
+        requests.push_back(world.isend(moves[outgoing[k]].second, topology_tag, out_sizes[k]));
+    }
+    for (int k = 0; k < incoming.size(); ++k) {
+        requests.push_back(world.irecv(holders[incoming[k]], topology_tag, in_sizes[k]));
+    }
+    wait_all(requests.begin(), requests.end());
+    requests.clear();
+
+    vector<string> in_buffers(incoming.size());
+    for (int k = 0; k < outgoing.size(); ++k) {
+        const string& buffer = out_buffers[k];
+        for (uint64_t offset = 0; offset < buffer.size(); offset += chunk_size) {
+            int n = min<uint64_t>(chunk_size, buffer.size() - offset);
+            requests.push_back(world.isend(moves[outgoing[k]].second, chunk_tag, buffer.data() + offset, n));
+        }
+    }
+    for (int k = 0; k < incoming.size(); ++k) {
+        string& buffer = in_buffers[k];
+        buffer.resize(in_sizes[k]);
+        for (uint64_t offset = 0; offset < buffer.size(); offset += chunk_size) {
+            int n = min<uint64_t>(chunk_size, buffer.size() - offset);
+            requests.push_back(world.irecv(holders[incoming[k]], chunk_tag, &buffer[offset], n));
+        }
+    }
+    wait_all(requests.begin(), requests.end());
+
+    for (int k = 0; k < incoming.size(); ++k) {
+        zone z;
+        bool saved;
+        Topology* t = deserialize_topology(geos, in_buffers[k], z, saved);
+        in_buffers[k].clear();
+        put(geos, &z, t, saved);
+    }
+
+    if (!outgoing.empty() || !incoming.empty()) {
+        uint64_t sent = 0, received = 0;
+        for (uint64_t size : out_sizes) sent += size;
+        for (uint64_t size : in_sizes) received += size;
+
+        auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start);
+        cout << "[" << world.rank() << "] sent " << outgoing.size() << " topologies (" << sent
+             << " bytes), received " << incoming.size() << " (" << received << " bytes), took: "
+             << elapsed.count() << " ms" << endl;
+    }
+}
+
+void topology_store::checkpoint(GEOSHelper* geos)
+{
+    for (auto& p : _entries) {
+        entry& e = p.second;
+        if (!e.saved) {
+            save_topology(geos, e.z, e.topology);
+            e.saved = true;
+        }
+    }
+}
+
+map<int, size_t> topology_store::holdings() const
+{
+    map<int, size_t> held;
+    for (const auto& p : _entries) {
+        held[p.first] = p.second.bytes;
+    }
+    return held;
+}
+
+void topology_store::gather_holdings(vector< map<int, size_t> >& holdings)
+{
+    communicator world;
+
+    map<int, size_t> held = instance().holdings();
+    if (world.rank() == 0) {
+        gather(world, held, holdings, 0);
+    }
+    else {
+        gather(world, held, 0);
+    }
+}
+
+} // namespace cma
@@ -0,0 +1,221 @@
+#ifndef __CMA_STORE_H
+#define __CMA_STORE_H
+
+#include <map>
+#include <list>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/mpi/request.hpp>
+
+#include <types.h>
+#include <utils.h>
+#include <topology.h>
+
+namespace cma {
+
+/**
+ * Topologies kept resident in the memory of a rank between merges.
+ *
+ * In resident mode, zone and merged topologies are put in the store of the
+ * rank which produced them instead of being saved to
+ * topology-<hexwkb>.ser, and shipped to the rank merging them with MPI
+ * point-to-point messages (see send() and transfer()). They only reach the
+ * disk through checkpoint(). Topologies which are not resident anywhere (e.g.
+ * when resuming a merge) are still restored from disk.
+ *
+ * With a memory budget, the store also works as a cache of the topologies
+ * produced by a rank when they go through the disk: merging them on the
+ * same rank then skips their restoration. Once the budget is exceeded the
+ * least recently stored topologies are evicted, after being saved if they
+ * only exist in memory.
+ *
+ * fetch() and put() may be called from several threads (see
+ * set_merge_threads()), other members may not.
+ */
+class topology_store
+{
+public:
+    topology_store() {}
+    ~topology_store();
+
+    topology_store(const topology_store&) = delete;
+    topology_store& operator=(const topology_store&) = delete;
+
+    /**
+     * Store of the process.
+     */
+    static topology_store& instance();
+
+    /**
+     * Resident mode (default: off, topologies go through the disk).
+     */
+    static void resident(bool enabled) {
+        s_resident = enabled;
+    }
+    static bool resident() {
+        return s_resident;
+    }
+
+    /**
+     * Memory budget in bytes of the store (default: 0/unbounded when
+     * resident, no caching otherwise).
+     */
+    static void budget(size_t bytes) {
+        s_budget = bytes;
+    }
+    static size_t budget() {
+        return s_budget;
+    }
+
+    /**
+     * Merge tasks run by a rank between two checkpoint() of its resident
+     * topologies, 0 for never (default: 4).
+     */
+    static void checkpoint_interval(int tasks) {
+        s_checkpoint_interval = tasks;
+    }
+    static int checkpoint_interval() {
+        return s_checkpoint_interval;
+    }
+
+    /**
+     * Whether topologies produced by this rank should be put in the store.
+     */
+    static bool enabled() {
+        return s_resident || s_budget > 0;
+    }
+
+    bool contains(int zoneId) const;
+
+    /**
+     * Keep the topology of a zone, taking ownership of it. saved tells
+     * whether it is already checkpointed to disk. geos is used to save the
+     * topologies evicted to stay within budget().
+     */
+    void put(GEOSHelper* geos, zone* z, Topology* t, bool saved=false);
+
+    /**
+     * Remove the topology of a zone from the store and return it, or
+     * nullptr if it is not resident on this rank.
+     */
+    Topology* take(int zoneId);
+
+    /**
+     * Take the topology of a zone (a hit) or restore it from disk (a miss).
+     * A stored topology of another zone with the same id is dropped.
+     */
+    Topology* fetch(GEOSHelper* geos, zone* z);
+
+    /**
+     * Ship the topology of a zone to rank dest, which gets it with
+     * receive(). The messages are non-blocking, see wait_sends(). If the
+     * topology is no longer resident (evicted to disk), dest is told so and
+     * restores it from disk when it fetches it.
+     *
+     * Both ranks must agree on the order of the topologies they exchange,
+     * e.g. because rank 0 tells them.
+     */
+    void send(int zoneId, int dest);
+
+    /**
+     * Put the next topology shipped by rank source with send() in the store.
+     */
+    void receive(GEOSHelper* geos, int source);
+
+    /**
+     * Complete the messages of send().
+     */
+    void wait_sends();
+
+    /**
+     * Move the topology of a zone to the store of rank dest, wherever it
+     * is resident (no-op if it is not resident on any rank).
+     *
+     * This is a collective operation, all ranks must call it in the same
+     * order with the same arguments.
+     */
+    void transfer(GEOSHelper* geos, int zoneId, int dest);
+
+    /**
+     * Same as transfer() for a batch of (zone id, dest) moves, with a single
+     * collective to locate the topologies. They are then all shipped at
+     * once with non-blocking point-to-point messages, in chunks so that
+     * topologies over 2GB can be sent.
+     */
+    void transfer(GEOSHelper* geos, const std::vector< std::pair<int, int> >& moves);
+
+    /**
+     * Save resident topologies modified since their last checkpoint.
+     */
+    void checkpoint(GEOSHelper* geos);
+
+    size_t size() const {
+        return _entries.size();
+    }
+
+    size_t bytes() const {
+        return _bytes;
+    }
+
+    /**
+     * Estimated memory of the topologies of the store by zone id.
+     */
+    std::map<int, size_t> holdings() const;
+
+    /**
+     * Gather holdings() of every rank on rank 0 (collective).
+     */
+    static void gather_holdings(std::vector< std::map<int, size_t> >& holdings);
+
+    uint64_t hits() const {
+        return _hits;
+    }
+    uint64_t misses() const {
+        return _misses;
+    }
+    uint64_t evictions() const {
+        return _evictions;
+    }
+
+    void reset_stats() {
+        _hits = _misses = _evictions = 0;
+    }
+
+private:
+    struct entry {
+        zone* z;
+        Topology* topology;
+        bool saved;
+        size_t bytes;
+        uint64_t stored;        // _clock value when stored, for eviction
+    };
+
+    std::map<int, entry> _entries;
+    size_t _bytes = 0;
+    uint64_t _clock = 0;
+
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+    uint64_t _evictions = 0;
+
+    // serialized topologies being sent
+    struct outgoing {
+        uint64_t size;
+        std::string buffer;
+        std::vector<boost::mpi::request> requests;
+    };
+    std::list<outgoing> _sends;
+
+    void _evict(GEOSHelper* geos, int keepId);
+
+    static bool s_resident;
+    static size_t s_budget;
+    static int s_checkpoint_interval;
+};
+
+} // namespace cma
+
+#endif // __CMA_STORE_H
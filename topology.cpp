@@ -9,6 +9,7 @@
 #include <algorithm>
 
 #include <st.h>
+#include <fixed.h>
 
 using namespace std;
 
@@ -36,6 +37,9 @@ struct item_finder_predicate
     }
 };
 
+bool Topology::s_deferred_faces = false;
+double Topology::s_line_budget = 0.;
+
 Topology::Topology()
 : Topology(nullptr)
 {
@@ -51,6 +55,7 @@ Topology::Topology(GEOSHelper* geos)
 , _inserted_edges(new vector<int>())
 , _inserted_faces(new vector<int>())
 , _topogeom_relations(new map<int, int>())
+, _relation_keys(new unordered_map< int, unordered_multiset<uint64_t> >())
 , _tr_track_geom(new set<GEOSGeometry*>())
 , _geos(geos)
 , _edge_idx(new edge_idx_t)
@@ -59,7 +64,7 @@ Topology::Topology(GEOSHelper* geos)
 , _node_tol_idx(new edge_idx_t)
 , _left_faces_idx(new vector<edgeid_set_ptr>())
 , _right_faces_idx(new vector<edgeid_set_ptr>())
-, _face_geometries(new vector<GEOSGeometry*>())
+, _face_geometries(new face_geometry_cache())
 , _gfg_geometries(new vector<GEOSGeometry*>())
 {
     if (geos) {
@@ -75,8 +80,6 @@ Topology::Topology(GEOSHelper* geos)
 
         _left_faces_idx->push_back(edgeid_set_ptr(new edgeid_set));
         _right_faces_idx->push_back(edgeid_set_ptr(new edgeid_set));
-
-        _face_geometries->push_back(nullptr);
     }
 }
 
@@ -99,11 +102,6 @@ Topology::~Topology()
         delete _right_faces_idx;
     }
 
-    for (GEOSGeometry* geom : *_face_geometries) {
-        if (geom) {
-            GEOSGeom_destroy_r(hdl, geom);
-        }
-    }
     delete _face_geometries;
 
     assert (_gfg_geometries->empty());
@@ -116,6 +114,7 @@ Topology::~Topology()
     delete _inserted_faces;
 
     delete _topogeom_relations;
+    delete _relation_keys;
 
     assert (_tr_track_geom->empty());
     delete _tr_track_geom;
@@ -133,20 +132,104 @@ Topology::~Topology()
     _relations.clear();
 }
 
-void Topology::TopoGeo_AddLineString(int line_id, GEOSGeom line, double tolerance)
+/**
+ * Deadline of the line being added by the calling thread while its GEOS
+ * operations may be interrupted (see geos_interrupt).
+ */
+static thread_local const chrono::steady_clock::time_point* geos_deadline = nullptr;
+
+#if GEOS_VERSION_MAJOR > 3 || (GEOS_VERSION_MAJOR == 3 && GEOS_VERSION_MINOR >= 12)
+static int _geos_interrupt_callback(void*)
 {
-    assert (GEOSGeomTypeId_r(hdl, line) == GEOS_LINESTRING);
+    return geos_deadline && chrono::steady_clock::now() > *geos_deadline;
+}
+#endif
+
+geos_interrupt::geos_interrupt(const chrono::steady_clock::time_point* deadline)
+{
+#if GEOS_VERSION_MAJOR > 3 || (GEOS_VERSION_MAJOR == 3 && GEOS_VERSION_MINOR >= 12)
+    if (deadline) {
+        geos_deadline = deadline;
+        GEOSContext_setInterruptCallback_r(hdl, _geos_interrupt_callback, nullptr);
+        _armed = true;
+    }
+#endif
+}
+
+void geos_interrupt::disarm()
+{
+#if GEOS_VERSION_MAJOR > 3 || (GEOS_VERSION_MAJOR == 3 && GEOS_VERSION_MINOR >= 12)
+    if (_armed) {
+        GEOSContext_setInterruptCallback_r(hdl, nullptr, nullptr);
+        geos_deadline = nullptr;
+        _armed = false;
+    }
+#endif
+}
+
+void Topology::_throw_over_budget()
+{
+    _line_over_budget = true;
+    throw line_budget_exceeded();
+}
+
+void Topology::TopoGeo_AddLineString(int line_id, GEOSGeom line, double tolerance, bool prenoded, bool budgeted)
+{
+    assert (GEOSGeomTypeId_r(hdl, line) == GEOS_LINESTRING ||
+        (prenoded && GEOSGeomTypeId_r(hdl, line) == GEOS_MULTILINESTRING));
+
+    // undone by rollback() if the line runs past its budget, it is added again later
+    _line_count_mark = _totalCount;
+    _line_relations_mark = _relations.size();
 
     ++_totalCount;
 
+    _budgeted = budgeted && s_line_budget > 0;
+    if (_budgeted) {
+        _deadline = chrono::steady_clock::now() +
+            chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(s_line_budget));
+    }
+
+    if (s_deferred_faces && !_stale_faces) {
+        _drop_faces();
+    }
+
     // cout << "Topology::TopoGeo_AddLineString(" << _geos->as_string(line) << ")" << endl;
 
     if (tolerance <= 0) {
         tolerance = _ST_MinTolerance(line);
     }
 
+    // GEOS may stop the noding below once the budget is exceeded
+    geos_interrupt interrupt(_budgeted ? &_deadline : nullptr);
+
+    GEOSGeom noded;
+
+    // an interrupted or failed GEOS operation leaves noded null
+    auto check_noded = [&]() {
+        if (_over_budget()) {
+            GEOSGeom_destroy_r(hdl, noded);
+            _throw_over_budget();
+        }
+        if (!noded) {
+            throw invalid_argument("cannot node line");
+        }
+    };
+
     // 1. Self-node
-    GEOSGeom noded = GEOSUnaryUnion_r(hdl, line);
+    if (prenoded) {
+        noded = GEOSGeom_clone_r(hdl, line);
+    }
+    else if (fixed_grid()) {
+        GEOSGeometry* snapped = snap_to_grid(line);
+        noded = GEOSUnaryUnion_r(hdl, snapped);
+        GEOSGeom_destroy_r(hdl, snapped);
+    }
+    else {
+        noded = GEOSUnaryUnion_r(hdl, line);
+    }
+
+    check_noded();
 
     // 2. Node to edges falling within tolerance distance
     vector<GEOSGeom> nearby;
@@ -173,21 +256,27 @@ void Topology::TopoGeo_AddLineString(int line_id, GEOSGeom line, double toleranc
         GEOSGeometry* snapped = ST_Snap(noded, iedges, tolerance);
 
         GEOSGeom_destroy_r(hdl, noded);
-        noded = GEOSDifference_r(hdl, snapped, iedges);
+        noded = nullptr;
 
-        GEOSGeometry* set1 = GEOSIntersection_r(hdl, snapped, iedges);
-        GEOSGeometry* set2 = GEOSLineMerge_r(hdl, set1);
+        if (snapped) {
+            GEOSGeometry* diff = GEOSDifference_r(hdl, snapped, iedges);
+            GEOSGeometry* set1 = GEOSIntersection_r(hdl, snapped, iedges);
+            GEOSGeometry* set2 = set1 ? GEOSLineMerge_r(hdl, set1) : nullptr;
 
-        GEOSGeometry* tmp = noded;
-        noded = GEOSUnion_r(hdl, noded, set2);
+            if (diff && set2) {
+                noded = GEOSUnion_r(hdl, diff, set2);
+            }
 
-        GEOSGeom_destroy_r(hdl, tmp);
-        GEOSGeom_destroy_r(hdl, set1);
-        GEOSGeom_destroy_r(hdl, set2);
-        GEOSGeom_destroy_r(hdl, snapped);
+            GEOSGeom_destroy_r(hdl, diff);
+            GEOSGeom_destroy_r(hdl, set1);
+            GEOSGeom_destroy_r(hdl, set2);
+            GEOSGeom_destroy_r(hdl, snapped);
+        }
     }
     GEOSGeom_destroy_r(hdl, iedges);
 
+    check_noded();
+
     // 2.1 Node with existing nodes within tolerance
     v1.clear();
     _intersects<edge_idx_t, edge_value>(_node_tol_idx, noded, v1);
@@ -214,7 +303,7 @@ void Topology::TopoGeo_AddLineString(int line_id, GEOSGeom line, double toleranc
 
         int nbNodes = GEOSGetNumGeometries_r(hdl, inodes);
 
-        for (int i = 0; i < nbNodes; ++i) {
+        for (int i = 0; noded && i < nbNodes; ++i) {
             const GEOSGeometry* pt = GEOSGetGeometryN_r(hdl, inodes, i);
             assert (GEOSGeomTypeId_r(hdl, pt) == GEOS_POINT);
 
@@ -227,13 +316,26 @@ void Topology::TopoGeo_AddLineString(int line_id, GEOSGeom line, double toleranc
             GEOSGeom_destroy_r(hdl, tmp);
         }
 
-        tmp = noded;
-        noded = GEOSUnaryUnion_r(hdl, noded);
-        GEOSGeom_destroy_r(hdl, tmp);
+        if (noded) {
+            tmp = noded;
+            noded = GEOSUnaryUnion_r(hdl, noded);
+            GEOSGeom_destroy_r(hdl, tmp);
+        }
     }
     GEOSGeom_destroy_r(hdl, inodes);
 
-    assert (noded);
+    check_noded();
+
+    if (fixed_grid()) {
+        // noding may have introduced intersection points off the grid
+        GEOSGeometry* tmp = noded;
+        noded = node_on_grid(noded);
+        GEOSGeom_destroy_r(hdl, tmp);
+        check_noded();
+    }
+
+    // pieces are checked one at a time below, GEOS operations must complete
+    interrupt.disarm();
 
     int topogeoId = _relations.size();
     _relations.push_back(nullptr);
@@ -242,6 +344,11 @@ void Topology::TopoGeo_AddLineString(int line_id, GEOSGeom line, double toleranc
     vector<edge_value> results_s;
     int nbNodes = GEOSGetNumGeometries_r(hdl, noded);
     for (int i = 0; i < nbNodes; ++i) {
+        if (_over_budget()) {
+            GEOSGeom_destroy_r(hdl, noded);
+            _throw_over_budget();
+        }
+
         const GEOSGeometry* rec = GEOSGetGeometryN_r(hdl, noded, i);
 
         GEOSGeometry* sp = ST_StartPoint(rec);
@@ -309,6 +416,7 @@ void Topology::TopoGeo_AddLineString(int line_id, GEOSGeom line, double toleranc
         add_relation(topogeoId, r, true);
     }
     GEOSGeom_destroy_r(hdl, noded);
+    _budgeted = false;
 
     assert (_topogeom_relations->count(line_id) == 0);
     (*_topogeom_relations)[line_id] = topogeoId;
@@ -326,7 +434,12 @@ int Topology::ST_AddEdgeModFace(int start_node, int end_node, GEOSGeometry* geom
     assert (!_is_null(end_node) && end_node < _nodes.size());
     assert (geom && GEOSGeomTypeId_r(hdl, geom) == GEOS_LINESTRING);
 
-    if (GEOSisSimple_r(hdl, geom) != 1) {
+    // face splits dominate pathological lines, stop before taking ownership of geom
+    if (_over_budget()) {
+        _throw_over_budget();
+    }
+
+    if (fixed_grid() ? !is_simple(geom) : GEOSisSimple_r(hdl, geom) != 1) {
         throw invalid_argument("SQL/MM Spatial exception - curve not simple");
     }
 
@@ -335,7 +448,7 @@ int Topology::ST_AddEdgeModFace(int start_node, int end_node, GEOSGeometry* geom
 
     edge* newEdge = new edge();
     newEdge->id = _edges.size();
-    newEdge->geom = geom;
+    newEdge->set_geom(geom);
     newEdge->start_node = start_node;
     newEdge->end_node = end_node;
 
@@ -448,10 +561,16 @@ int Topology::ST_AddEdgeModFace(int start_node, int end_node, GEOSGeometry* geom
     vector<edge*>* edgesToStartNode = new vector<edge*>();
     vector<edge*>* edgesToEndNode = new vector<edge*>();
 
-    for (const edge* e : _edges)
+    // edges of both nodes, read from the link arrays rather than every edge
+    for (int id = 0; id < _links.size(); ++id)
     {
-        if (!e) continue;
+        if (!_links.exists(id)) continue;
+
+        int sn = _links.start_node[id];
+        int en = _links.end_node[id];
+        if (sn != start_node && en != start_node && sn != end_node && en != end_node) continue;
 
+        const edge* e = _edges[id];
         edge* ne;
         GEOSGeom g;
 
@@ -461,7 +580,7 @@ int Topology::ST_AddEdgeModFace(int start_node, int end_node, GEOSGeometry* geom
                 ne->end_node = -1;
 
                 g = ne->geom;
-                ne->geom = ST_RemoveRepeatedPoints(g);
+                ne->set_geom(ST_RemoveRepeatedPoints(g));
                 GEOSGeom_destroy_r(hdl, g);
 
                 edgesToStartNode->push_back(ne);
@@ -472,7 +591,7 @@ int Topology::ST_AddEdgeModFace(int start_node, int end_node, GEOSGeometry* geom
                 ne->start_node = -1;
 
                 g = ne->geom;
-                ne->geom = ST_RemoveRepeatedPoints(g);
+                ne->set_geom(ST_RemoveRepeatedPoints(g));
                 GEOSGeom_destroy_r(hdl, g);
 
                 edgesToStartNode->push_back(ne);
@@ -484,7 +603,7 @@ int Topology::ST_AddEdgeModFace(int start_node, int end_node, GEOSGeometry* geom
                 ne = new edge(e, false);
                 ne->end_node = -1;
 
-                ne->geom = ST_RemoveRepeatedPoints(ne->geom);
+                ne->set_geom(ST_RemoveRepeatedPoints(ne->geom));
                 edgesToEndNode->push_back(ne);
             }
 
@@ -492,7 +611,7 @@ int Topology::ST_AddEdgeModFace(int start_node, int end_node, GEOSGeometry* geom
                 ne = new edge(e, false);
                 ne->start_node = -1;
 
-                ne->geom = ST_RemoveRepeatedPoints(ne->geom);
+                ne->set_geom(ST_RemoveRepeatedPoints(ne->geom));
                 edgesToEndNode->push_back(ne);
             }
         }
@@ -503,13 +622,13 @@ int Topology::ST_AddEdgeModFace(int start_node, int end_node, GEOSGeometry* geom
         scedge->start_node = -1;
         scedge->left_face = 0;
         scedge->right_face = 0;
-        scedge->geom = GEOSGeom_clone_r(hdl, cleangeom);
+        scedge->set_geom(GEOSGeom_clone_r(hdl, cleangeom));
 
         edge* ecedge = new edge(newEdge, false);
         ecedge->end_node = -1;
         ecedge->left_face = 0;
         ecedge->right_face = 0;
-        ecedge->geom = GEOSGeom_clone_r(hdl, cleangeom);
+        ecedge->set_geom(GEOSGeom_clone_r(hdl, cleangeom));
 
         edgesToStartNode->push_back(scedge);
         edgesToEndNode->push_back(ecedge);
@@ -519,24 +638,27 @@ int Topology::ST_AddEdgeModFace(int start_node, int end_node, GEOSGeometry* geom
 
     _find_links_to_node(start_node, *edgesToStartNode, span, true, newEdge, isclosed);
 
+    // edges whose links now point to the new edge
+    int prevLeftEdge, prevRightEdge;
+
     if (_is_null(span.nextCW)) {
         newEdge->next_right_edge = newEdge->id;
-        newEdge->prev_left_edge = -newEdge->id;
+        prevLeftEdge = -newEdge->id;
     }
     else {
         newEdge->next_right_edge = span.nextCW;
-        newEdge->prev_left_edge = -span.nextCCW;
+        prevLeftEdge = -span.nextCCW;
     }
 
     _find_links_to_node(end_node, *edgesToEndNode, epan, false, newEdge, isclosed);
 
     if (_is_null(epan.nextCW)) {
         newEdge->next_left_edge = -newEdge->id;
-        newEdge->prev_right_edge = newEdge->id;
+        prevRightEdge = newEdge->id;
     }
     else {
         newEdge->next_left_edge = epan.nextCW;
-        newEdge->prev_right_edge = -epan.nextCCW;
+        prevRightEdge = -epan.nextCCW;
     }
 
     delete_all(*edgesToStartNode);
@@ -557,47 +679,44 @@ int Topology::ST_AddEdgeModFace(int start_node, int end_node, GEOSGeometry* geom
 
     add_edge(newEdge);
 
-    if (abs(newEdge->prev_left_edge) != newEdge->id) {
-        if (newEdge->prev_left_edge > 0) {
-            edge* e = _edges[newEdge->prev_left_edge];
+    if (abs(prevLeftEdge) != newEdge->id) {
+        if (prevLeftEdge > 0) {
+            edge* e = _edges[prevLeftEdge];
 
             _transactions->push_back(new EdgeTransaction(*this, e));
 
             e->next_left_edge = newEdge->id;
-            e->abs_next_left_edge = newEdge->id;
+            _store_links(e);
         }
         else {
-            edge* e = _edges[-newEdge->prev_left_edge];
+            edge* e = _edges[-prevLeftEdge];
 
             _transactions->push_back(new EdgeTransaction(*this, e));
 
             e->next_right_edge = newEdge->id;
-            e->abs_next_right_edge = newEdge->id;
+            _store_links(e);
         }
     }
 
-    if (abs(newEdge->prev_right_edge) != newEdge->id) {
-        if (newEdge->prev_right_edge > 0) {
-            edge* e = _edges[newEdge->prev_right_edge];
+    if (abs(prevRightEdge) != newEdge->id) {
+        if (prevRightEdge > 0) {
+            edge* e = _edges[prevRightEdge];
 
             _transactions->push_back(new EdgeTransaction(*this, e));
 
             e->next_left_edge = -newEdge->id;
-            e->abs_next_left_edge = newEdge->id;
+            _store_links(e);
         }
         else {
-            edge* e = _edges[-newEdge->prev_right_edge];
+            edge* e = _edges[-prevRightEdge];
 
             _transactions->push_back(new EdgeTransaction(*this, e));
 
             e->next_right_edge = -newEdge->id;
-            e->abs_next_right_edge = newEdge->id;
+            _store_links(e);
         }
     }
 
-    newEdge->prev_left_edge = NULLint;
-    newEdge->prev_right_edge = NULLint;
-
     if (span.was_isolated || epan.was_isolated) {
         _nodes[start_node]->containing_face = NULLint;
         _nodes[end_node]->containing_face = NULLint;
@@ -606,6 +725,11 @@ int Topology::ST_AddEdgeModFace(int start_node, int end_node, GEOSGeometry* geom
     int oEdgeId = newEdge->id;
     int oLeftFace = newEdge->left_face;
 
+    if (s_deferred_faces) {
+        // faces will be computed by build_faces()
+        return oEdgeId;
+    }
+
     int newFaceId = _ST_AddFaceSplit(oEdgeId, oLeftFace, false);
 
     if (newFaceId == 0) {
@@ -661,7 +785,7 @@ int Topology::_ST_AddFaceSplit(int edgeId, int faceId, bool mbrOnly)
     GetRingEdges(edgeId, newRingEdges);
 
     // IF fan.newring_edges @> ARRAY[-anedge] THEN
-    if (_is_in(-edgeId, newRingEdges)) {
+    if (_in_last_ring(-edgeId)) {
         return 0;
     }
 
@@ -682,7 +806,12 @@ int Topology::_ST_AddFaceSplit(int edgeId, int faceId, bool mbrOnly)
         GEOSGeom_destroy_r(hdl, g);
     }
 
+    // ring coordinates are kept for the point in polygon tests below
     double x, y;
+    vector<double> ringXs, ringYs;
+    ringXs.reserve(ptgeoms.size()+1);
+    ringYs.reserve(ptgeoms.size()+1);
+
     GEOSCoordSequence* points = GEOSCoordSeq_create_r(hdl, ptgeoms.size()+1, 2);
     for (int i = 0; i < ptgeoms.size(); ++i) {
         GEOSGeometry* pt = ptgeoms[i];
@@ -692,6 +821,8 @@ int Topology::_ST_AddFaceSplit(int edgeId, int faceId, bool mbrOnly)
 
         GEOSCoordSeq_setX_r(hdl, points, i, x);
         GEOSCoordSeq_setY_r(hdl, points, i, y);
+        ringXs.push_back(x);
+        ringYs.push_back(y);
 
         GEOSGeom_destroy_r(hdl, pt);
     }
@@ -700,6 +831,8 @@ int Topology::_ST_AddFaceSplit(int edgeId, int faceId, bool mbrOnly)
     GEOSCoordSeq_getY_r(hdl, points, 0, &y);
     GEOSCoordSeq_setX_r(hdl, points, ptgeoms.size(), x);
     GEOSCoordSeq_setY_r(hdl, points, ptgeoms.size(), y);
+    ringXs.push_back(x);
+    ringYs.push_back(y);
     ptgeoms.clear();
 
     GEOSGeometry* lr = GEOSGeom_createLinearRing_r(hdl, points);
@@ -710,9 +843,15 @@ int Topology::_ST_AddFaceSplit(int edgeId, int faceId, bool mbrOnly)
         0
     );
 
-    GEOSGeometry* forceRHR = ST_ForceRHR(shell_geoms);
-    bool isccw = GEOSEqualsExact_r(hdl, shell_geoms, forceRHR, 0.) == 0;
-    GEOSGeom_destroy_r(hdl, forceRHR);
+    bool isccw;
+    if (fixed_grid()) {
+        isccw = is_ccw(shell_geoms);
+    }
+    else {
+        GEOSGeometry* forceRHR = ST_ForceRHR(shell_geoms);
+        isccw = GEOSEqualsExact_r(hdl, shell_geoms, forceRHR, 0.) == 0;
+        GEOSGeom_destroy_r(hdl, forceRHR);
+    }
 
     if (faceId == 0 && !isccw) {
         GEOSGeom_destroy_r(hdl, shell_geoms);
@@ -722,7 +861,7 @@ int Topology::_ST_AddFaceSplit(int edgeId, int faceId, bool mbrOnly)
     if (mbrOnly && faceId != 0) {
         if (isccw) {
             _transactions->push_back(new FaceTransaction(*this, _faces[faceId]));
-            _faces[faceId]->geom = ST_Envelope(shell_geoms);
+            _faces[faceId]->set_geom(ST_Envelope(shell_geoms));
         }
 
         GEOSGeom_destroy_r(hdl, shell_geoms);
@@ -733,16 +872,16 @@ int Topology::_ST_AddFaceSplit(int edgeId, int faceId, bool mbrOnly)
     newFace->id = _faces.size();
     if (faceId != 0 && !isccw) {
         if (_faces[faceId]->geom == nullptr) {
-            newFace->geom = nullptr;
+            newFace->set_geom(nullptr);
         }
         else {
-            newFace->geom = GEOSGeom_clone_r(hdl, _faces[faceId]->geom);
+            newFace->set_geom(GEOSGeom_clone_r(hdl, _faces[faceId]->geom));
         }
     }
     else {
         // Don't use GEOSEnvelope_r here since you won't get the same order as ST_Envelope.
         // It would be slightly faster but we want to generate the exact same topology.
-        newFace->geom = ST_Envelope(shell_geoms);
+        newFace->set_geom(ST_Envelope(shell_geoms));
     }
     add_face(newFace);
 
@@ -759,54 +898,102 @@ int Topology::_ST_AddFaceSplit(int edgeId, int faceId, bool mbrOnly)
 
     bool ishole = (faceId != 0 && !isccw);
 
-    vector<int> absNewRingEdges;
-    transform(newRingEdges.begin(), newRingEdges.end(), back_inserter(absNewRingEdges), [](int id){
-        return abs(id);
-    });
-
     edgeid_set* faceEdges = new edgeid_set;
     _face_edges(faceId, *faceEdges);
 
-    GEOSGeometry* env = GEOSEnvelope_r(hdl, shell_geoms);
+    double ringMinX = *min_element(ringXs.begin(), ringXs.end());
+    double ringMaxX = *max_element(ringXs.begin(), ringXs.end());
+    double ringMinY = *min_element(ringYs.begin(), ringYs.end());
+    double ringMaxY = *max_element(ringYs.begin(), ringYs.end());
+
+    // sqlmm.sql.in:~3092, one probe point per face edge whose envelope
+    // intersects the ring's, all tested at once.
+    vector<edge*> probedEdges;
+    vector<char> probed;
+    vector<double> probeXs, probeYs;
+    vector<double> xs, ys;
     for (int _id : *faceEdges) {
         assert (_id != 0);
         edge* e = _edges[_id];
 
-        if (!_is_in(e->id, absNewRingEdges))
-        {
-            GEOSGeom closestPoint = ST_LineInterpolatePoint(e->geom, 0.2);
-            // sqlmm.sql.in:~3092
-            bool c = e->envelope() && GEOSIntersects_r(hdl, env, e->envelope()) == 1 && ST_Contains(shell_geoms, closestPoint);
-            GEOSGeom_destroy_r(hdl, closestPoint);
+        if (_in_last_ring(e->id) || _in_last_ring(-e->id)) {
+            continue;
+        }
 
-            c = ishole ? !c : c;
+        const GEOSCoordSequence* seq = GEOSGeom_getCoordSeq_r(hdl, e->geom);
+        unsigned int size;
+        GEOSCoordSeq_getSize_r(hdl, seq, &size);
+        xs.resize(size);
+        ys.resize(size);
+        for (unsigned int i = 0; i < size; ++i) {
+            GEOSCoordSeq_getX_r(hdl, seq, i, &xs[i]);
+            GEOSCoordSeq_getY_r(hdl, seq, i, &ys[i]);
+        }
 
-            if (c) {
-                if (e->left_face == faceId) {
-                    _update_left_face(e, newFace->id);
-                }
-                if (e->right_face == faceId) {
-                    _update_right_face(e, newFace->id);
-                }
+        bool intersects =
+            *max_element(xs.begin(), xs.end()) >= ringMinX &&
+            *min_element(xs.begin(), xs.end()) <= ringMaxX &&
+            *max_element(ys.begin(), ys.end()) >= ringMinY &&
+            *min_element(ys.begin(), ys.end()) <= ringMaxY;
+
+        probedEdges.push_back(e);
+        probed.push_back(intersects);
+        if (intersects) {
+            line_interpolate_point(xs, ys, 0.2, x, y);
+            probeXs.push_back(x);
+            probeYs.push_back(y);
+        }
+    }
+
+    vector<char> inside;
+    points_in_ring(ringXs, ringYs, probeXs, probeYs, inside);
+
+    for (size_t i = 0, p = 0; i < probedEdges.size(); ++i) {
+        edge* e = probedEdges[i];
+
+        bool c = probed[i] && inside[p];
+        if (probed[i]) ++p;
+
+        c = ishole ? !c : c;
+
+        if (c) {
+            if (e->left_face == faceId) {
+                _update_left_face(e, newFace->id);
+            }
+            if (e->right_face == faceId) {
+                _update_right_face(e, newFace->id);
             }
         }
     }
-    GEOSGeom_destroy_r(hdl, env);
 
     delete faceEdges;
 
-    // GEOSGeom_destroy_r(hdl, shell_env);
-
+    // nodes of the split face, tested the same way
+    vector<node*> probedNodes;
+    probeXs.clear();
+    probeYs.clear();
     for (node* n : _nodes) {
         if (!n) continue;
         if (n->containing_face == faceId) {
-            bool c = ST_Contains(shell_geoms, n->geom);
-            c = ishole ? !c : c;
+            GEOSGeomGetX_r(hdl, n->geom, &x);
+            GEOSGeomGetY_r(hdl, n->geom, &y);
+            probedNodes.push_back(n);
+            probeXs.push_back(x);
+            probeYs.push_back(y);
+        }
+    }
 
-            if (c) {
-                _transactions->push_back(new NodeTransaction(*this, n));
-                n->containing_face = newFace->id;
-            }
+    points_in_ring(ringXs, ringYs, probeXs, probeYs, inside);
+
+    for (size_t i = 0; i < probedNodes.size(); ++i) {
+        node* n = probedNodes[i];
+
+        bool c = inside[i];
+        c = ishole ? !c : c;
+
+        if (c) {
+            _transactions->push_back(new NodeTransaction(*this, n));
+            n->containing_face = newFace->id;
         }
     }
 
@@ -817,31 +1004,70 @@ int Topology::_ST_AddFaceSplit(int edgeId, int faceId, bool mbrOnly)
 
 void Topology::GetRingEdges(int edgeId, vector<int>& ringEdgeIds, int maxEdges)
 {
-    edge* currentEdge = _edges[abs(edgeId)];
+    if (++_ring_generation == 0) {
+        // wrapped around, forget all previous walks
+        fill(_ring_visits.begin(), _ring_visits.end(), 0);
+        _ring_generation = 1;
+    }
+    if (_ring_visits.size() < 2 * _edges.size()) {
+        _ring_visits.resize(2 * _edges.size(), 0);
+    }
 
     int n = 0;
     while (true) {
-        assert (currentEdge);
-        if (_is_in(edgeId, ringEdgeIds)) {
+        assert (_links.exists(edgeId));
+        uint32_t& visit = _ring_visits[2 * abs(edgeId) + (edgeId < 0 ? 1 : 0)];
+        if (visit == _ring_generation) {
             break;
         }
+        visit = _ring_generation;
 
         ringEdgeIds.push_back(edgeId);
 
-        if (edgeId < 0) {
-            edgeId = currentEdge->next_right_edge;
-            currentEdge = _edges[abs(edgeId)];
-        }
-        else {
-            edgeId = currentEdge->next_left_edge;
-            currentEdge = _edges[abs(edgeId)];
-        }
+        edgeId = _links.next(edgeId);
 
         if (!_is_null(maxEdges) && ++n > maxEdges) {
             // Max traversing limit hit.
             throw exception();
         }
     }
+
+    _ring_stats.add(ringEdgeIds.size());
+}
+
+void ring_stats::add(uint64_t length)
+{
+    ++walks;
+    edges += length;
+    max_edges = max(max_edges, length);
+
+    int bucket = 0;
+    while (bucket < BUCKETS-1 && (length >> (bucket+1)) > 0) {
+        ++bucket;
+    }
+    ++histogram[bucket];
+}
+
+void ring_stats::merge(const ring_stats& other)
+{
+    walks += other.walks;
+    edges += other.edges;
+    max_edges = max(max_edges, other.max_edges);
+    for (int i = 0; i < BUCKETS; ++i) {
+        histogram[i] += other.histogram[i];
+    }
+}
+
+void ring_stats::print(ostream& os) const
+{
+    os << "  ring walks: " << walks << " edges: " << edges
+       << " (avg " << (walks ? double(edges) / walks : 0.) << ", max " << max_edges << ")"
+       << " lengths:";
+    for (int i = 0; i < BUCKETS; ++i) {
+        if (histogram[i] == 0) continue;
+        os << " " << (uint64_t(1) << i) << (i == BUCKETS-1 ? "+" : "") << ":" << histogram[i];
+    }
+    os << endl;
 }
 
 void Topology::_find_links_to_node(int nodeId, std::vector<edge*>& edges, _span_t& pan, bool span, edge* newEdge, bool isclosed)
@@ -883,16 +1109,16 @@ void Topology::_find_links_to_node(int nodeId, std::vector<edge*>& edges, _span_
             if (abs(e->id) != newEdge->id) {
                 if (e->id < 0) {
                     if (span) {
-                        newEdge->left_face = e->left_face;
+                        newEdge->left_face = _links.left_face[abs(e->id)];
                     } else {
-                        newEdge->right_face = e->left_face;
+                        newEdge->right_face = _links.left_face[abs(e->id)];
                     }
                 }
                 else {
                     if (span) {
-                        newEdge->left_face = e->right_face;
+                        newEdge->left_face = _links.right_face[abs(e->id)];
                     } else {
-                        newEdge->right_face = e->right_face;
+                        newEdge->right_face = _links.right_face[abs(e->id)];
                     }
                 }
             }
@@ -904,16 +1130,16 @@ void Topology::_find_links_to_node(int nodeId, std::vector<edge*>& edges, _span_
             if (abs(e->id) != newEdge->id) {
                 if (e->id < 0) {
                     if (span) {
-                        newEdge->right_face = e->right_face;
+                        newEdge->right_face = _links.right_face[abs(e->id)];
                     } else {
-                        newEdge->left_face = e->right_face;
+                        newEdge->left_face = _links.right_face[abs(e->id)];
                     }
                 }
                 else {
                     if (span) {
-                        newEdge->right_face = e->left_face;
+                        newEdge->right_face = _links.left_face[abs(e->id)];
                     } else {
-                        newEdge->left_face = e->left_face;
+                        newEdge->left_face = _links.left_face[abs(e->id)];
                     }
                 }
             }
@@ -938,7 +1164,7 @@ int Topology::ST_ChangeEdgeGeom(int edgeId, const GEOSGeom acurve)
         throw invalid_argument("SQL/MM Spatial exception - invalid curve");
     }
 
-    if (GEOSisSimple_r(hdl, acurve) != 1) {
+    if (fixed_grid() ? !is_simple(acurve) : GEOSisSimple_r(hdl, acurve) != 1) {
         throw invalid_argument("SQL/MM Spatial exception - curve not simple");
     }
 
@@ -951,22 +1177,27 @@ int Topology::ST_ChangeEdgeGeom(int edgeId, const GEOSGeom acurve)
     GEOSGeom_destroy_r(hdl, sp2);
 
     if (oldEdge->start_node == oldEdge->end_node) {
-        GEOSGeom range = ST_MakePolygon(oldEdge->geom);
-
-        GEOSGeometry* forceRHR = ST_ForceRHR(range);
-        bool iscw = ST_OrderingEquals(range, forceRHR);
-        GEOSGeom_destroy_r(hdl, range);
-        GEOSGeom_destroy_r(hdl, forceRHR);
-
         GEOSGeometry* g = ST_RemoveRepeatedPoints(acurve);
         assert (GEOSGeomGetNumPoints_r(hdl, g) >= 3);
         GEOSGeom_destroy_r(hdl, g);
 
-        range = ST_MakePolygon(acurve);
-        forceRHR = ST_ForceRHR(range);
-        assert (iscw == ST_OrderingEquals(range, forceRHR));
-        GEOSGeom_destroy_r(hdl, range);
-        GEOSGeom_destroy_r(hdl, forceRHR);
+        if (fixed_grid()) {
+            assert (is_ccw(oldEdge->geom) == is_ccw(acurve));
+        }
+        else {
+            GEOSGeom range = ST_MakePolygon(oldEdge->geom);
+
+            GEOSGeometry* forceRHR = ST_ForceRHR(range);
+            bool iscw = ST_OrderingEquals(range, forceRHR);
+            GEOSGeom_destroy_r(hdl, range);
+            GEOSGeom_destroy_r(hdl, forceRHR);
+
+            range = ST_MakePolygon(acurve);
+            forceRHR = ST_ForceRHR(range);
+            assert (iscw == ST_OrderingEquals(range, forceRHR));
+            GEOSGeom_destroy_r(hdl, range);
+            GEOSGeom_destroy_r(hdl, forceRHR);
+        }
     }
     else {
         GEOSGeometry* ep1 = ST_EndPoint(acurve);
@@ -1123,7 +1354,11 @@ int Topology::ST_ChangeEdgeGeom(int edgeId, const GEOSGeom acurve)
     _ST_AdjacentEdges(oldEdge->end_node, -edgeId, preEndEdgeIds);
 
     _transactions->push_back(new EdgeTransaction(*this, _edges[edgeId]));
-    _edges[edgeId]->geom = acurve;
+    _edges[edgeId]->set_geom(acurve);
+
+    // the face rings changed shape
+    _face_geometries->invalidate(oldEdge->left_face);
+    _face_geometries->invalidate(oldEdge->right_face);
 
     vector<int> postStartEdgeIds;
     vector<int> postEndEdgeIds;
@@ -1139,7 +1374,7 @@ int Topology::ST_ChangeEdgeGeom(int edgeId, const GEOSGeom acurve)
         _transactions->push_back(new FaceTransaction(*this, f));
 
         GEOSGeometry* faceGeom = ST_GetFaceGeometry(oldEdge->left_face);
-        f->geom = ST_Envelope(faceGeom);
+        f->set_geom(ST_Envelope(faceGeom));
     }
 
     if (oldEdge->right_face != 0 && oldEdge->right_face != oldEdge->left_face) {
@@ -1148,7 +1383,7 @@ int Topology::ST_ChangeEdgeGeom(int edgeId, const GEOSGeom acurve)
         _transactions->push_back(new FaceTransaction(*this, f));
 
         GEOSGeometry* faceGeom = ST_GetFaceGeometry(oldEdge->right_face);
-        f->geom = ST_Envelope(faceGeom);
+        f->set_geom(ST_Envelope(faceGeom));
     }
 
     return edgeId;
@@ -1175,7 +1410,7 @@ int Topology::ST_ModEdgeSplit(int edgeId, const GEOSGeom point)
 
     node* newNode = new node();
     newNode->id = _nodes.size();
-    newNode->geom = point;
+    newNode->set_geom(point);
     add_node(newNode);
 
     GEOSGeometry* tmp;
@@ -1199,31 +1434,33 @@ int Topology::ST_ModEdgeSplit(int edgeId, const GEOSGeom point)
     newEdge->next_right_edge = -edgeId;
     newEdge->left_face = oldEdge->left_face;
     newEdge->right_face = oldEdge->right_face;
-    newEdge->geom = newedge2;
+    newEdge->set_geom(newedge2);
 
     add_edge(newEdge);
 
     _transactions->push_back(new EdgeTransaction(*this, oldEdge));
 
-    oldEdge->geom = newedge1;
+    oldEdge->set_geom(newedge1);
     oldEdge->next_left_edge = newEdge->id;
-    oldEdge->abs_next_left_edge = newEdge->id;
     oldEdge->end_node = newNode->id;
+    _store_links(oldEdge);
 
-    for (edge* e : _edges) {
-        if (!e) continue;
-        if (e->id != newEdge->id) {
-            if (e->next_right_edge == -edgeId && e->start_node == oeEndNode) {
-                _transactions->push_back(new EdgeTransaction(*this, e));
-                e->next_right_edge = -newEdge->id;
-                e->abs_next_right_edge = newEdge->id;
-            }
-            if (e->next_left_edge == -edgeId && e->end_node == oeEndNode) {
-                _transactions->push_back(new EdgeTransaction(*this, e));
-                e->next_left_edge = -newEdge->id;
-                e->abs_next_left_edge = newEdge->id;
-            }
+    for (int id = 1; id < _links.size(); ++id) {
+        if (id == newEdge->id || !_links.exists(id)) continue;
+
+        bool right = _links.next_right_edge[id] == -edgeId && _links.start_node[id] == oeEndNode;
+        bool left = _links.next_left_edge[id] == -edgeId && _links.end_node[id] == oeEndNode;
+        if (!right && !left) continue;
+
+        edge* e = _edges[id];
+        _transactions->push_back(new EdgeTransaction(*this, e));
+        if (right) {
+            e->next_right_edge = -newEdge->id;
+        }
+        if (left) {
+            e->next_left_edge = -newEdge->id;
         }
+        _store_links(e);
     }
 
     for (int topogeoId = 1; topogeoId < _relations.size(); ++topogeoId)
@@ -1337,8 +1574,9 @@ GEOSGeometry* Topology::ST_GetFaceGeometry(int faceId)
     // face 0 is invalid (universal face)
     assert (faceId > 0 && faceId < _faces.size() && _faces[faceId] != nullptr);
 
-    if ((*_face_geometries)[faceId]) {
-        return (*_face_geometries)[faceId];
+    GEOSGeometry* cached = _face_geometries->get(faceId);
+    if (cached) {
+        return cached;
     }
 
     edgeid_set edgeIds;
@@ -1370,7 +1608,7 @@ GEOSGeometry* Topology::ST_GetFaceGeometry(int faceId)
     GEOSGeom_destroy_r(hdl, coll);
     _gfg_geometries->clear();
 
-    (*_face_geometries)[faceId] = ret;
+    _face_geometries->put(faceId, ret);
 
     return ret;
 }
@@ -1504,7 +1742,7 @@ int Topology::ST_AddIsoNode(int faceId, const GEOSGeom pt)
 
     node* newNode = new node;
     newNode->id = _nodes.size();
-    newNode->geom = GEOSGeom_clone_r(hdl, pt);
+    newNode->set_geom(GEOSGeom_clone_r(hdl, pt));
     newNode->containing_face = containing_face;
     add_node(newNode);
 
@@ -1592,34 +1830,53 @@ void Topology::output_relations() const
 }
 
 void Topology::pg_output() const
+{
+    pg_output("", id_offsets());
+}
+
+void Topology::pg_output(
+    const string& suffix,
+    const id_offsets& o,
+    bool append,
+    const map<int, int64_t>& shared) const
 {
     std::ofstream ofs;
+    ios::openmode mode = append ? ios::out | ios::app : ios::out;
+
+    // the universal face (and null faces) are the same in every topology
+    auto face_id = [&o](int faceId) -> int64_t {
+        return faceId == 0 || _is_null(faceId) ? faceId : faceId + o.face;
+    };
+    auto signed_edge_id = [&o](int edgeId) -> int64_t {
+        return edgeId < 0 ? edgeId - o.edge : edgeId + o.edge;
+    };
 
-    ofs.open("node.csv");
+    ofs.open("node" + suffix + ".csv", mode);
     assert (ofs.is_open());
     for (const node* n : _nodes) {
         if (!n) continue;
-        ofs << n->id << "," << (_is_null(n->containing_face) ? "" : to_string(n->containing_face))
+        ofs << n->id + o.node << "," << (_is_null(n->containing_face) ? "" : to_string(face_id(n->containing_face)))
             << ",SRID=3395;" << _geos->as_string(n->geom) << endl;
     }
     ofs.close();
 
-    ofs.open("edge_data.csv");
+    ofs.open("edge_data" + suffix + ".csv", mode);
     assert (ofs.is_open());
     for (const edge* e : _edges) {
         if (!e) continue;
-        ofs << e->id << "|" << e->start_node << "|" << e->end_node << "|" << e->next_left_edge << "|"
-            << e->abs_next_left_edge << "|" << e->next_right_edge << "|" << e->abs_next_right_edge << "|"
-            << e->left_face << "|" << e->right_face << "|"
+        ofs << e->id + o.edge << "|" << e->start_node + o.node << "|" << e->end_node + o.node << "|"
+            << signed_edge_id(e->next_left_edge) << "|" << e->abs_next_left_edge() + o.edge << "|"
+            << signed_edge_id(e->next_right_edge) << "|" << e->abs_next_right_edge() + o.edge << "|"
+            << face_id(e->left_face) << "|" << face_id(e->right_face) << "|"
             << "SRID=3395;" << _geos->as_string(e->geom) << endl;
     }
     ofs.close();
 
-    ofs.open("face.csv");
+    ofs.open("face" + suffix + ".csv", mode);
     assert (ofs.is_open());
     for (const face* f : _faces) {
         if (!f || f->id == 0) continue;
-        ofs << f->id << "|";
+        ofs << face_id(f->id) << "|";
         if (f->geom) {
             ofs << "SRID=3395;" << _geos->as_string(f->geom);
         }
@@ -1627,30 +1884,90 @@ void Topology::pg_output() const
     }
     ofs.close();
 
-    ofs.open("relation.csv");
+    // local topogeo id -> id given by the caller
+    map<int, int64_t> shared_ids;
+    for (const auto& p : shared) {
+        auto it = _topogeom_relations->find(p.first);
+        if (it != _topogeom_relations->end()) {
+            shared_ids[it->second] = p.second;
+        }
+    }
+    auto topogeo_id = [&](int topogeoId) -> int64_t {
+        auto it = shared_ids.find(topogeoId);
+        return it == shared_ids.end() ? topogeoId + o.topogeo : it->second;
+    };
+
+    ofs.open("relation" + suffix + ".csv", mode);
     assert (ofs.is_open());
     for (const vector<relation*>* relations : _relations) {
         if (!relations) continue;
         for (int i = 0; i < relations->size(); ++i) {
             relation* r = (*relations)[i];
             if (!r) continue;
-            ofs << r->topogeo_id << "," << r->layer_id << ","
-                << r->element_id << "," << r->element_type << ""
+            ofs << topogeo_id(r->topogeo_id) << "," << r->layer_id << ","
+                << (r->element_type == 3 ? face_id(r->element_id)
+                    : r->element_id + (r->element_type == 1 ? o.node : o.edge)) << ","
+                << r->element_type << ""
                 << endl;
         }
     }
     ofs.close();
 
-    ofs.open("topo_geom.sql");
+    ofs.open("topo_geom" + suffix + ".sql", mode);
     assert (ofs.is_open());
     for (auto& p : *_topogeom_relations) {
-        ofs << "UPDATE way SET topo_geom=topology.GetTopoGeom('way_topo', "
-            << "2, 1, " << p.second << ") WHERE id=" << p.first << ";"
-            << endl;
+        if (shared.count(p.first)) continue;
+        pg_topo_geom(ofs, p.first, p.second + o.topogeo);
     }
     ofs.close();
 }
 
+void Topology::pg_topo_geom(ostream& os, int lineId, int64_t topogeoId)
+{
+    os << "UPDATE way SET topo_geom=topology.GetTopoGeom('way_topo', "
+       << "2, 1, " << topogeoId << ") WHERE id=" << lineId << ";"
+       << endl;
+}
+
+size_t Topology::memory_bytes() const
+{
+    size_t bytes = sizeof(Topology) + _face_geometries->bytes();
+
+    for (const node* n : _nodes) {
+        if (!n) continue;
+        bytes += sizeof(node) + (n->geom ? _geometry_bytes(n->geom) : 0);
+    }
+    for (const edge* e : _edges) {
+        if (!e) continue;
+        bytes += sizeof(edge) + (e->geom ? _geometry_bytes(e->geom) : 0);
+    }
+    for (const face* f : _faces) {
+        if (!f) continue;
+        bytes += sizeof(face) + (f->geom ? _geometry_bytes(f->geom) : 0);
+    }
+    for (const vector<relation*>* relations : _relations) {
+        if (!relations) continue;
+        bytes += relations->size() * (sizeof(relation) + sizeof(relation*));
+    }
+
+    // two R-tree entries per edge and node, a face index slot per edge side
+    bytes += 2 * _edge_idx->size() * sizeof(edge_value) + 2 * _node_idx->size() * sizeof(node_value);
+    bytes += 2 * _edges.size() * sizeof(int);
+
+    return bytes;
+}
+
+id_offsets Topology::id_counts() const
+{
+    // slot 0 is never used (and missing in topologies created without GEOS helper)
+    id_offsets counts;
+    counts.node = max<int64_t>(_nodes.size(), 1) - 1;
+    counts.edge = max<int64_t>(_edges.size(), 1) - 1;
+    counts.face = max<int64_t>(_faces.size(), 1) - 1;
+    counts.topogeo = max<int64_t>(_relations.size(), 1) - 1;
+    return counts;
+}
+
 void Topology::_update_indexes(const edge* e, bool transaction)
 {
     assert (e);
@@ -1743,9 +2060,6 @@ void Topology::add_edge(edge* e)
     assert (e->geom);
     assert (GEOSGeomTypeId_r(hdl, e->geom) == GEOS_LINESTRING);
 
-    e->abs_next_left_edge = abs(e->next_left_edge);
-    e->abs_next_right_edge = abs(e->next_right_edge);
-
     if (e->id == _edges.size()) {
         _edges.push_back(e);
     }
@@ -1753,18 +2067,13 @@ void Topology::add_edge(edge* e)
         assert (_edges[e->id] == nullptr);
         _edges[e->id] = e;
     }
+    _store_links(e);
 
     _update_indexes(e);
 
-    if ((*_face_geometries)[e->left_face]) {
-        GEOSGeom_destroy_r(hdl, (*_face_geometries)[e->left_face]);
-        (*_face_geometries)[e->left_face] = nullptr;
-    }
-
-    if ((*_face_geometries)[e->right_face]) {
-        GEOSGeom_destroy_r(hdl, (*_face_geometries)[e->right_face]);
-        (*_face_geometries)[e->right_face] = nullptr;
-    }
+    // the new edge is part of the rings of its faces
+    _face_geometries->invalidate(e->left_face);
+    _face_geometries->invalidate(e->right_face);
 
     _inserted_edges->push_back(e->id);
 }
@@ -1797,8 +2106,6 @@ void Topology::add_face(face* f)
     _left_faces_idx->push_back(edgeid_set_ptr(new edgeid_set));
     _right_faces_idx->push_back(edgeid_set_ptr(new edgeid_set));
 
-    _face_geometries->push_back(nullptr);
-
     _inserted_faces->push_back(f->id);
 }
 
@@ -1815,21 +2122,55 @@ void Topology::add_relation(int topogeoId, relation* r, bool dupcheck)
     }
     assert (topogeoId < _relations.size());
 
+    vector<relation*>* relations = _relations[topogeoId];
+
+    // hashed keys of long relation lists, built once they reach the threshold
+    auto keys = _relation_keys->find(topogeoId);
+    if (keys == _relation_keys->end() && relations->size() >= RELATION_HASH_THRESHOLD) {
+        keys = _relation_keys->insert(make_pair(topogeoId, unordered_multiset<uint64_t>())).first;
+        for (const relation* other : *relations) {
+            keys->second.insert(_relation_key(*other));
+        }
+    }
+
     if (dupcheck) {
-        auto it = find_if(
-            _relations[topogeoId]->begin(),
-            _relations[topogeoId]->end(),
-            [r](const relation* other) {
+        bool duplicate;
+        if (keys != _relation_keys->end()) {
+            duplicate = keys->second.count(_relation_key(*r)) > 0;
+        }
+        else {
+            duplicate = find_if(relations->begin(), relations->end(), [r](const relation* other) {
                 return *r == *other;
-            }
-        );
-        if (it != _relations[topogeoId]->end()) {
+            }) != relations->end();
+        }
+
+        if (duplicate) {
+            delete r;
             return;
         }
     }
 
     _transactions->push_back(new AddRelationTransaction(*this, r));
-    _relations[topogeoId]->push_back(r);
+    relations->push_back(r);
+    if (keys != _relation_keys->end()) {
+        keys->second.insert(_relation_key(*r));
+    }
+}
+
+void Topology::_remove_relation_key(const relation* r)
+{
+    auto keys = _relation_keys->find(r->topogeo_id);
+    if (keys == _relation_keys->end()) {
+        return;
+    }
+
+    auto it = keys->second.find(_relation_key(*r));
+    assert (it != keys->second.end());
+    keys->second.erase(it);
+
+    if (keys->second.empty()) {
+        _relation_keys->erase(keys);
+    }
 }
 
 void Topology::remove_edge(int edgeId)
@@ -1851,6 +2192,7 @@ void Topology::remove_edge(int edgeId)
     _edge_tol_idx->remove(results[0]);
 
     _edges[edgeId] = nullptr;
+    _links.erase(edgeId);
     delete e;
 }
 
@@ -1899,6 +2241,8 @@ void Topology::commit()
 
 void Topology::rollback()
 {
+    _budgeted = false;
+
     auto tItr = _transactions->rbegin();
     for (; tItr < _transactions->rend(); ++tItr) {
         (*tItr)->rollback();
@@ -1907,6 +2251,21 @@ void Topology::rollback()
     _transactions->clear();
     _tr_track_geom->clear();
 
+    if (_line_over_budget) {
+        // the line will be counted and get a topogeo id when retried
+        _totalCount = _line_count_mark;
+        while (_relations.size() > _line_relations_mark) {
+            vector<relation*>* relations = _relations.back();
+            if (relations) {
+                delete_all(*relations);
+                delete relations;
+            }
+            _relation_keys->erase(_relations.size() - 1);
+            _relations.pop_back();
+        }
+        _line_over_budget = false;
+    }
+
     /**
      * delete all nodes, edges and faces we added since
      * the last commit.
@@ -1933,18 +2292,31 @@ void Topology::rollback()
 }
 
 void Topology::rebuild_indexes()
+{
+    _rebuild_indexes(nullptr);
+}
+
+void Topology::rebuild_indexes(const OGREnvelope& region)
+{
+    _rebuild_indexes(&region);
+}
+
+void Topology::_rebuild_indexes(const OGREnvelope* region)
 {
     assert (_transactions->empty());
 
     assert (_left_faces_idx->size() == _right_faces_idx->size());
-    assert (_right_faces_idx->size() == _face_geometries->size());
+
+    _edge_idx->clear();
+    _edge_tol_idx->clear();
+    _node_idx->clear();
+    _node_tol_idx->clear();
 
     int faceCount = _faces.size();
     for (int i = 0 ; i < faceCount; ++i) {
         if (i >= _left_faces_idx->size()) {
             _left_faces_idx->push_back(edgeid_set_ptr(new edgeid_set));
             _right_faces_idx->push_back(edgeid_set_ptr(new edgeid_set));
-            _face_geometries->push_back(nullptr);
         }
         else {
             if ((*_left_faces_idx)[i]) {
@@ -1957,35 +2329,49 @@ void Topology::rebuild_indexes()
     }
     assert (_faces.size() == _left_faces_idx->size());
 
-    for (const edge* e : _edges) {
+    // anything closer than that to region may be reached by the tolerance boxes
+    const double margin = 2 * DEFAULT_TOLERANCE;
+    auto in_region = [region, margin](const double* bbox) {
+        return !region || (bbox &&
+            bbox[0] <= region->MaxX + margin && bbox[2] >= region->MinX - margin &&
+            bbox[1] <= region->MaxY + margin && bbox[3] >= region->MinY - margin);
+    };
+
+    for (edge* e : _edges) {
         if (!e) continue;
-        _update_indexes(e, false);
-        if ((*_face_geometries)[e->left_face]) {
-            GEOSGeom_destroy_r(hdl, (*_face_geometries)[e->left_face]);
-            (*_face_geometries)[e->left_face] = nullptr;
+        if (in_region(e->bbox())) {
+            _update_indexes(e, false);
         }
-        if ((*_face_geometries)[e->right_face]) {
-            GEOSGeom_destroy_r(hdl, (*_face_geometries)[e->right_face]);
-            (*_face_geometries)[e->right_face] = nullptr;
+        else {
+            (*_left_faces_idx)[e->left_face]->insert(e->id);
+            (*_right_faces_idx)[e->right_face]->insert(e->id);
         }
     }
 
-    for (const node* n : _nodes) {
+    for (node* n : _nodes) {
         if (!n) continue;
-        _update_indexes(n, false);
-    }
-
-    // invalidate face geometry cache
-    for (int i = 0; i < _face_geometries->size(); ++i) {
-        GEOSGeometry* faceGeom = (*_face_geometries)[i];
-        if (faceGeom) {
-            GEOSGeom_destroy_r(hdl, faceGeom);
-            (*_face_geometries)[i] = nullptr;
+        if (in_region(n->bbox())) {
+            _update_indexes(n, false);
         }
     }
 
+    // face rings are unchanged, cached face geometries are kept
+
     commit();
     assert (_transactions->empty());
+
+    _index = region == nullptr;
+}
+
+void Topology::_rebuild_links()
+{
+    _links.clear();
+    _links.resize(_edges.size());
+
+    for (const edge* e : _edges) {
+        if (!e) continue;
+        _links.set(e);
+    }
 }
 
 void Topology::output_edges() const
@@ -2000,9 +2386,9 @@ void Topology::output_edges() const
              << e->start_node << " | "
              << e->end_node << " | "
              << e->next_left_edge << " | "
-             << e->abs_next_left_edge << " | "
+             << e->abs_next_left_edge() << " | "
              << e->next_right_edge << " | "
-             << e->abs_next_right_edge << " | "
+             << e->abs_next_right_edge() << " | "
              << e->left_face << " | "
              << e->right_face << " | "
              << _geos->as_string(e->geom)
@@ -2011,9 +2397,9 @@ void Topology::output_edges() const
              << e->start_node << "|"
              << e->end_node << "|"
              << e->next_left_edge << "|"
-             << e->abs_next_left_edge << "|"
+             << e->abs_next_left_edge() << "|"
              << e->next_right_edge << "|"
-             << e->abs_next_right_edge << "|"
+             << e->abs_next_right_edge() << "|"
              << e->left_face << "|"
              << e->right_face << "|"
              << _geos->as_string(e->geom)
@@ -2120,13 +2506,13 @@ void Topology::_update_left_face(edge* e, int faceId)
         e->id
     ));
 
+    // the edge leaves the ring of its old face for the new one's
+    _face_geometries->invalidate(e->left_face);
+    _face_geometries->invalidate(faceId);
+
     e->left_face = faceId;
+    _store_links(e);
     (*_left_faces_idx)[faceId]->insert(e->id);
-
-    if ((*_face_geometries)[faceId]) {
-        GEOSGeom_destroy_r(hdl, (*_face_geometries)[faceId]);
-        (*_face_geometries)[faceId] = nullptr;
-    }
 }
 
 void Topology::_update_right_face(edge* e, int faceId)
@@ -2149,13 +2535,13 @@ void Topology::_update_right_face(edge* e, int faceId)
         e->id
     ));
 
+    // the edge leaves the ring of its old face for the new one's
+    _face_geometries->invalidate(e->right_face);
+    _face_geometries->invalidate(faceId);
+
     e->right_face = faceId;
+    _store_links(e);
     (*_right_faces_idx)[faceId]->insert(e->id);
-
-    if ((*_face_geometries)[faceId]) {
-        GEOSGeom_destroy_r(hdl, (*_face_geometries)[faceId]);
-        (*_face_geometries)[faceId] = nullptr;
-    }
 }
 
 void Topology::_face_edges(int faceId, edgeid_set& edges)
@@ -2200,11 +2586,15 @@ void Topology::_empty(bool free_items)
     _node_tol_idx->clear();
 
     _topogeom_relations->clear();
+    _relation_keys->clear();
+    _links.clear();
 
     _totalCount = 0;
 
     _left_faces_idx->clear();
     _right_faces_idx->clear();
+
+    _face_geometries->clear();
 }
 
 void GEOM2BOOSTMLS(const GEOSGeometry* in, multi_linestring& mls)
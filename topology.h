@@ -2,11 +2,17 @@
 #define __CMA_TOPOLOGY_H
 
 #include <set>
+#include <chrono>
 #include <limits>
+#include <map>
 #include <memory>
+#include <ostream>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
 #include <geos_c.h>
 #include <algorithm>
+#include <stdexcept>
 
 #include <boost/tuple/tuple.hpp>
 
@@ -23,14 +29,64 @@
 #include <st.h>
 #include <types.h>
 #include <utils.h>
+#include <facecache.h>
 #include <transaction.h>
 
 #define DEFAULT_TOLERANCE 1.0
 #define DEFAULT_TOPOGEO_ID 1
 #define DEFAULT_LAYER_ID 1
 
+/**
+ * Relation lists of a TopoGeometry at least this long are deduplicated
+ * through a hash of their relations instead of a linear search.
+ */
+#define RELATION_HASH_THRESHOLD 16
+
 namespace cma {
 
+/**
+ * Offsets added to the ids of a topology written along other ones (see
+ * Topology::pg_output()), or id counts of a topology. The universal face
+ * keeps id 0 in every topology.
+ */
+struct id_offsets
+{
+    int64_t node = 0;
+    int64_t edge = 0;
+    int64_t face = 0;
+    int64_t topogeo = 0;
+};
+
+/**
+ * Thrown by TopoGeo_AddLineString() when a line runs past its budget
+ * (see Topology::line_budget()). The line is not invalid, the caller is
+ * expected to roll it back and may retry it later without a budget.
+ */
+class line_budget_exceeded : public std::exception
+{
+public:
+    const char* what() const noexcept override {
+        return "line budget exceeded";
+    }
+};
+
+/**
+ * Let the GEOS operations of the calling thread give up (and return null)
+ * once the deadline has passed, until disarmed or destroyed. Requires
+ * GEOS 3.12 interrupt callbacks, does nothing with older versions.
+ */
+class geos_interrupt
+{
+public:
+    geos_interrupt(const std::chrono::steady_clock::time_point* deadline);
+    ~geos_interrupt() { disarm(); }
+
+    void disarm();
+
+private:
+    bool _armed = false;
+};
+
 /**
  * Internal structure used for _find_links_to_node azimuth computation.
  */
@@ -61,6 +117,88 @@ typedef boost::geometry::model::polygon<point> polygon;
 typedef boost::geometry::model::linestring<point> linestring;
 typedef boost::geometry::model::multi_linestring<linestring> multi_linestring;
 
+/**
+ * Edge links and faces as a structure of arrays indexed by edge id, the
+ * store traversals read (see Topology::links()): a ring walk only reads the
+ * next_left_edge/next_right_edge arrays, a node star the start_node/end_node
+ * ones. Missing edges have a NULLint start_node.
+ */
+class edge_table {
+  public:
+    std::vector<int> start_node;
+    std::vector<int> end_node;
+    std::vector<int> next_left_edge;
+    std::vector<int> next_right_edge;
+    std::vector<int> left_face;
+    std::vector<int> right_face;
+
+    size_t size() const {
+        return start_node.size();
+    }
+
+    bool exists(int edgeId) const {
+        size_t id = std::abs(edgeId);
+        return id < size() && start_node[id] != NULLint;
+    }
+
+    /**
+     * Next directed edge of the ring on the left of edgeId,
+     * on the right of -edgeId if it is negative.
+     */
+    int next(int edgeId) const {
+        return edgeId > 0 ? next_left_edge[edgeId] : next_right_edge[-edgeId];
+    }
+
+    void set(const edge* e) {
+        if (e->id >= size()) {
+            resize(e->id + 1);
+        }
+        start_node[e->id] = e->start_node;
+        end_node[e->id] = e->end_node;
+        next_left_edge[e->id] = e->next_left_edge;
+        next_right_edge[e->id] = e->next_right_edge;
+        left_face[e->id] = e->left_face;
+        right_face[e->id] = e->right_face;
+    }
+
+    void erase(int edgeId) {
+        if (edgeId < size()) {
+            start_node[edgeId] = NULLint;
+        }
+    }
+
+    void resize(size_t n) {
+        start_node.resize(n, NULLint);
+        end_node.resize(n, NULLint);
+        next_left_edge.resize(n, NULLint);
+        next_right_edge.resize(n, NULLint);
+        left_face.resize(n, NULLint);
+        right_face.resize(n, NULLint);
+    }
+
+    void clear() {
+        resize(0);
+    }
+};
+
+/**
+ * Ring length distribution of GetRingEdges() walks, used to
+ * see what the face split logic really costs.
+ */
+class ring_stats {
+  public:
+    static const int BUCKETS = 16;
+
+    uint64_t walks = 0;
+    uint64_t edges = 0;
+    uint64_t max_edges = 0;
+    uint64_t histogram[BUCKETS] = {};   // walks of [2^i, 2^(i+1)[ edges, last one unbounded
+
+    void add(uint64_t length);
+    void merge(const ring_stats& other);
+    void print(std::ostream& os) const;
+};
+
 class Topology
 {
     friend class boost::serialization::access;
@@ -80,12 +218,36 @@ public:
     Topology(GEOSHelper* geos);
     ~Topology();
 
+    /**
+     * Hand the topology over to the thread owning geos, a GEOSHelper
+     * cannot be used by other threads than its own.
+     */
+    void set_geos(GEOSHelper* geos) {
+        _geos = geos;
+    }
+
     /**
      * Add an edge (and it's endpoints) to the topology.
+     *
+     * If prenoded is set, line is expected to be already self-noded (see
+     * prescreen_lines()) and may be a multilinestring.
+     *
+     * If budgeted is set and a line budget is configured, throws
+     * line_budget_exceeded once the line has been running for longer than
+     * the budget; the topology must then be rolled back.
      */
-    void TopoGeo_AddLineString(int line_id, GEOSGeom line, double tolerance=0.);
+    void TopoGeo_AddLineString(int line_id, GEOSGeom line, double tolerance=0., bool prenoded=false, bool budgeted=false);
     int ST_AddEdgeModFace(int start_node, int end_node, GEOSGeometry* geom);
 
+    /**
+     * Build an empty topology from all of its lines at once.
+     *
+     * Lines are snapped to each other within tolerance, noded together in a
+     * single pass and loaded as a planar graph (see bulk.cpp). Lines are
+     * destroyed. Throws runtime_error if they cannot be noded.
+     */
+    void bulk_load(linesV& lines, double tolerance=DEFAULT_TOLERANCE);
+
     /*****************/
 
     int TopoGeo_AddPoint(GEOSGeom point, double tolerance=0.);
@@ -114,6 +276,67 @@ public:
 
     void rebuild_indexes();
 
+    /**
+     * Seam-local variant of rebuild_indexes(): only edges and nodes within
+     * tolerance of region go in the R-trees, the others are left out (face
+     * edge sets are always complete, face splits do not depend on the
+     * R-trees). Lines may then only be added within region and the
+     * topology is not considered indexed afterwards.
+     */
+    void rebuild_indexes(const OGREnvelope& region);
+
+    /**
+     * Whether the indexes are up to date, see rebuild_indexes().
+     * merge_topologies() carries them over when both topologies have them.
+     */
+    bool indexed() const {
+        return _index;
+    }
+
+    /**
+     * Links and faces of the edges, kept in sync with every edge change
+     * (and rollback). Edge objects carry the same values for serialization,
+     * output and transaction snapshots.
+     */
+    const edge_table& links() const {
+        return _links;
+    }
+
+    /**
+     * Deferred face mode (applies to all topologies of the process).
+     *
+     * Lines are added maintaining only nodes, edges and their next_left/
+     * next_right links, every edge staying on the universal face. Faces,
+     * their MBR, edge face labels and isolated nodes containing_face are
+     * then all computed at once by build_faces().
+     */
+    static void defer_faces(bool deferred) {
+        s_deferred_faces = deferred;
+    }
+    static bool deferred_faces() {
+        return s_deferred_faces;
+    }
+
+    /**
+     * Wall clock time in seconds a single budgeted TopoGeo_AddLineString()
+     * call may run for (applies to all topologies of the process, 0: no budget).
+     * Checked between noding stages and before each edge insertion.
+     */
+    static void line_budget(double seconds) {
+        s_line_budget = seconds;
+    }
+    static double line_budget() {
+        return s_line_budget;
+    }
+
+    /**
+     * Compute all faces from the edge links in a single ring traversal
+     * (no-op unless lines were added in deferred face mode since the last call).
+     * Connected components are processed concurrently on the OpenMP thread
+     * pool, face ids do not depend on the number of threads.
+     */
+    void build_faces();
+
     void output() const;
     void output_nodes() const;
     void output_edges() const;
@@ -122,6 +345,33 @@ public:
 
     void pg_output() const;
 
+    /**
+     * Write node<suffix>.csv, edge_data<suffix>.csv, face<suffix>.csv,
+     * relation<suffix>.csv and topo_geom<suffix>.sql with offsets added to
+     * every id, appending to existing files if append is set.
+     *
+     * The TopoGeometries of the lines in shared (by line id) are written
+     * with the given topogeo id instead, e.g. lines split between several
+     * topologies, and their topo_geom statement is left to the caller (see
+     * pg_topo_geom()).
+     */
+    void pg_output(
+        const std::string& suffix,
+        const id_offsets& offsets,
+        bool append=false,
+        const std::map<int, int64_t>& shared=std::map<int, int64_t>()) const;
+
+    /**
+     * Write the topo_geom statement of a line.
+     */
+    static void pg_topo_geom(std::ostream& os, int lineId, int64_t topogeoId);
+
+    /**
+     * Number of node, edge, face (universal face excluded) and topogeo id
+     * slots, i.e. the offsets of a topology written after this one.
+     */
+    id_offsets id_counts() const;
+
     const node* closest_and_within_node(const GEOSGeometry* geom, double tolerance);
     const edge* closest_and_within_edge(const GEOSGeometry* geom, double tolerance);
 
@@ -147,8 +397,28 @@ public:
         std::cout << "  " << zoneId() << " -- edge count: " << _edges.size()
              << " node count: " << _nodes.size() << " face count: "
              << _faces.size() << std::endl;
+        if (_ring_stats.walks > 0) {
+            _ring_stats.print(std::cout);
+        }
+        if (_face_geometries->hits() + _face_geometries->misses() > 0) {
+            _face_geometries->print_stats(std::cout);
+        }
     }
 
+    const ring_stats& ring_statistics() const {
+        return _ring_stats;
+    }
+
+    const face_geometry_cache& face_cache() const {
+        return *_face_geometries;
+    }
+
+    /**
+     * Rough memory used by the topology: elements, their geometries,
+     * indexes and cached face geometries.
+     */
+    size_t memory_bytes() const;
+
 private:
     std::vector<node*> _nodes;
     std::vector<edge*> _edges;
@@ -158,6 +428,21 @@ private:
     /**
      * Rollback data members
      */
+    /**
+     * See links(). An edge changed in place must be stored again with
+     * _store_links(), after its EdgeTransaction.
+     */
+    edge_table _links;
+
+    void _store_links(const edge* e) {
+        _links.set(e);
+    }
+
+    /**
+     * Fill _links from the edges, after they were loaded or rebuilt.
+     */
+    void _rebuild_links();
+
     std::vector<TopologyTransaction*>* _transactions = nullptr;
     std::vector<int>* _inserted_nodes = nullptr;
     std::vector<int>* _inserted_edges = nullptr;
@@ -169,6 +454,13 @@ private:
      */
     std::map<int, int>* _topogeom_relations;
 
+    /**
+     * Keys (see _relation_key()) of the relations of TopoGeometries with
+     * long relation lists, by topogeo_id. Kept in sync by add_relation()
+     * and its rollback, rebuilt from _relations when missing.
+     */
+    std::unordered_map< int, std::unordered_multiset<uint64_t> >* _relation_keys = nullptr;
+
     /**
      * Temporary vector to track geometry deletion
      * when a commit/rollback operation occurs.
@@ -206,8 +498,54 @@ private:
      */
     edge_idx_t* _node_tol_idx = NULL;
 
+    /**
+     * Whether the R-trees and face edge sets are up to date (they are not
+     * serialized). Cleared when restoring a topology, set by rebuild_indexes().
+     */
     bool _index = true;
 
+    /**
+     * Whether faces were dropped by the deferred face mode and
+     * must be computed by build_faces().
+     */
+    bool _stale_faces = false;
+
+    static bool s_deferred_faces;
+
+    static double s_line_budget;
+
+    /**
+     * Deadline of the TopoGeo_AddLineString() call in progress,
+     * only enforced while _budgeted is set.
+     */
+    std::chrono::steady_clock::time_point _deadline;
+    bool _budgeted = false;
+
+    bool _over_budget() const {
+        return _budgeted && std::chrono::steady_clock::now() > _deadline;
+    }
+
+    /**
+     * Throw line_budget_exceeded, rollback() then also forgets the line
+     * count and topogeo id of the line so that its retry does not add them
+     * again.
+     */
+    [[noreturn]] void _throw_over_budget();
+
+    bool _line_over_budget = false;
+    uint64_t _line_count_mark = 0;
+    size_t _line_relations_mark = 0;
+
+    /**
+     * Directed edges visited by GetRingEdges(): entry 2*id (left side) or
+     * 2*id+1 (right side) holds the generation of the last walk through it
+     * so that it never needs to be cleared between walks.
+     */
+    std::vector<uint32_t> _ring_visits;
+    uint32_t _ring_generation = 0;
+
+    ring_stats _ring_stats;
+
     /**
      * Total linestrings that were added to this topology.
      */
@@ -231,7 +569,7 @@ private:
     /**
      * Face geometry cache.
      */
-    std::vector<GEOSGeometry*>* _face_geometries = nullptr;
+    face_geometry_cache* _face_geometries = nullptr;
 
     /**
      * Temporary vector for ST_GetFaceGeometry operations.
@@ -241,7 +579,18 @@ private:
     void add_edge(edge* e);
     void add_node(node* n);
     void add_face(face* f);
+    /**
+     * Add a relation to a TopoGeometry, taking ownership of it. With dupcheck,
+     * a relation equal to an existing one is deleted instead.
+     */
     void add_relation(int topogeoId, relation* r, bool dupcheck = false);
+    void _remove_relation_key(const relation* r);
+
+    static uint64_t _relation_key(const relation& r) {
+        assert (r.layer_id >= 0 && r.layer_id < (1 << 24));
+        assert (r.element_type >= 0 && r.element_type < (1 << 8));
+        return (uint64_t(uint32_t(r.element_id)) << 32) | (uint64_t(r.layer_id) << 8) | uint64_t(r.element_type);
+    }
     void add_relation(int topogeoId, std::vector<relation*>* relations);
 
     void remove_edge(int edgeId);
@@ -258,13 +607,29 @@ private:
 
     void _empty(bool free_items=true);
 
+    /**
+     * Delete all faces but the universal one and relabel everything with it.
+     */
+    void _drop_faces();
+
     int _ST_AddFaceSplit(int edgeId, int faceId, bool mbrOnly);
     void GetRingEdges(int edgeId, std::vector<int>& ringEdgeIds, int maxEdges=NULLint);
+
+    /**
+     * Whether the directed edge is part of the ring returned by the last
+     * GetRingEdges() call.
+     */
+    bool _in_last_ring(int edgeId) const {
+        size_t slot = 2 * size_t(abs(edgeId)) + (edgeId < 0 ? 1 : 0);
+        return slot < _ring_visits.size() && _ring_visits[slot] == _ring_generation;
+    }
     void _find_links_to_node(int nodeId, std::vector<edge*>& edges, _span_t& pan, bool span, edge* newEdge, bool isclosed);
 
     template <class IndexType, class Value>
     void _intersects(IndexType* index, const GEOSGeometry* geom, std::vector<int>& ids, double tolerance = 0.);
 
+    void _rebuild_indexes(const OGREnvelope* region);
+
     template<class Archive>
     void save(Archive & ar, const unsigned int version) const;
     template<class Archive>
@@ -398,6 +763,7 @@ void Topology::load(Archive & ar, unsigned int version)
     if (version > 0) {
         ar & _totalOrphans;
     }
+    _rebuild_links();
     _index = false;
 }
 
@@ -29,6 +29,16 @@ void EdgeTransaction::rollback()
 {
     edge* oldEdge = _topology._edges[_edge->id];
     _topology._edges[_edge->id] = _edge;
+    _topology._store_links(_edge);
+
+    if (oldEdge->geom != _edge->geom) {
+        // face rings get their previous shape back
+        _topology._face_geometries->invalidate(oldEdge->left_face);
+        _topology._face_geometries->invalidate(oldEdge->right_face);
+        _topology._face_geometries->invalidate(_edge->left_face);
+        _topology._face_geometries->invalidate(_edge->right_face);
+    }
+
     _edge = oldEdge;
 }
 
@@ -107,10 +117,7 @@ void AddFaceIndexTransaction::rollback()
     assert (nelem == 1);
 
     // invalidate face geometry cache
-    if ((*_topology._face_geometries)[_faceId]) {
-        GEOSGeom_destroy_r(hdl, (*_topology._face_geometries)[_faceId]);
-        (*_topology._face_geometries)[_faceId] = nullptr;
-    }
+    _topology._face_geometries->invalidate(_faceId);
 }
 
 RemoveFaceIndexTransaction::RemoveFaceIndexTransaction(
@@ -135,10 +142,7 @@ void RemoveFaceIndexTransaction::rollback()
     (*_index)[_faceId]->insert(_edgeId);
 
     // invalidate face geometry cache
-    if ((*_topology._face_geometries)[_faceId]) {
-        GEOSGeom_destroy_r(hdl, (*_topology._face_geometries)[_faceId]);
-        (*_topology._face_geometries)[_faceId] = nullptr;
-    }
+    _topology._face_geometries->invalidate(_faceId);
 }
 
 AddRelationTransaction::AddRelationTransaction(Topology& topology, relation* r)
@@ -164,6 +168,7 @@ void AddRelationTransaction::rollback()
     auto it = find(relations->begin(), relations->end(), _relation);
     assert (it != relations->end());
 
+    _topology._remove_relation_key(_relation);
     delete *it;
     relations->erase(it);
 
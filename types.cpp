@@ -1,12 +1,11 @@
+#include <st.h>
 #include <types.h>
 #include <zones.h>
 
 #include <cassert>
+#include <algorithm>
 
-namespace cma {
-    extern GEOSContextHandle_t hdl;
-    GEOSWKBReader* geom_container::s_wkbr = nullptr;
-}
+using namespace std;
 
 namespace cma {
 
@@ -64,16 +63,22 @@ const GEOSPreparedGeometry* geom_container::prepared()
     return _prepared;
 }
 
-const GEOSGeometry* geom_container::envelope()
+const double* geom_container::bbox()
 {
     if (!geom) {
         return nullptr;
     }
 
-    if (!_envelope) {
-        _envelope = GEOSEnvelope_r(hdl, geom);
+    if (_bbox_geom != geom) {
+        vector<double> b;
+        _bbox_empty = !bounding_box(geom, b);
+        if (!_bbox_empty) {
+            copy(b.begin(), b.end(), _bbox);
+        }
+        _bbox_geom = geom;
     }
-    return _envelope;
+
+    return _bbox_empty ? nullptr : _bbox;
 }
 
 geom_container::~geom_container()
@@ -82,10 +87,6 @@ geom_container::~geom_container()
         GEOSPreparedGeom_destroy_r(hdl, _prepared);
     }
 
-    if (_envelope) {
-        GEOSGeom_destroy_r(hdl, _envelope);
-    }
-
     if (geom) {
         GEOSGeom_destroy_r(hdl, geom);
     }
@@ -93,7 +94,13 @@ geom_container::~geom_container()
 
 bool geom_container::intersects(const GEOSGeometry* geom)
 {
-    return GEOSIntersects_r(hdl, envelope(), geom) == 1;
+    const double* b1 = bbox();
+    vector<double> b2;
+    if (!b1 || !bounding_box(const_cast<GEOSGeometry*>(geom), b2)) {
+        return false;
+    }
+
+    return b1[0] <= b2[2] && b2[0] <= b1[2] && b1[1] <= b2[3] && b2[1] <= b1[3];
 }
 
 bool node::intersects(const GEOSGeometry* geom)
@@ -102,8 +109,8 @@ bool node::intersects(const GEOSGeometry* geom)
         double x1, y1, x2, y2;
         GEOSGeomGetX_r(hdl, this->geom, &x1);
         GEOSGeomGetY_r(hdl, this->geom, &y1);
-        GEOSGeomGetX_r(hdl, this->geom, &x2);
-        GEOSGeomGetY_r(hdl, this->geom, &y2);
+        GEOSGeomGetX_r(hdl, geom, &x2);
+        GEOSGeomGetY_r(hdl, geom, &y2);
         return x1 == x2 && y1 == y2;
     }
     return geom_container::intersects(geom);
@@ -2,6 +2,7 @@
 #define __CMA_TYPES_H
 
 #include <set>
+#include <cstdlib>
 #include <limits>
 #include <vector>
 #include <memory>
@@ -9,9 +10,12 @@
 #include <geos_c.h>
 #include <ogrsf_frmts.h>
 
+#include <utils.h>
+
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/serialization/base_object.hpp>
+#include <boost/serialization/version.hpp>
 #include <boost/serialization/split_member.hpp>
 
 #define NULLint std::numeric_limits<int>::max()
@@ -55,25 +59,46 @@ class geom_container
       geom_container() {}
       geom_container(const geom_container& other, bool clone = true): geom(other.geom) {
           if (clone) {
-              geom = GEOSGeom_clone(other.geom);
+              geom = GEOSGeom_clone_r(hdl, other.geom);
           }
       }
 
       virtual ~geom_container();
 
-      const GEOSGeometry* envelope();
       const GEOSPreparedGeometry* prepared();
 
+      /**
+       * Bounding box of geom as (minx, miny, maxx, maxy), or nullptr if it
+       * is null or empty. It is computed from the coordinates the first time
+       * and again after set_geom().
+       */
+      const double* bbox();
+
+      /**
+       * Replace geom (without destroying the previous one). Always use this
+       * rather than assigning geom: a new geometry may be allocated at the
+       * address of a destroyed one, so the bounding box cannot be
+       * invalidated by comparing pointers only.
+       */
+      void set_geom(GEOSGeometry* g) {
+          geom = g;
+          _bbox_geom = NULL;
+      }
+
+      /**
+       * Whether the bounding boxes of geom and of the given geometry overlap.
+       */
       virtual bool intersects(const GEOSGeometry* geom);
 
       GEOSGeometry* geom = NULL;
 
-      static GEOSWKBReader* s_wkbr;
-
   protected:
-      GEOSGeometry* _envelope = NULL;
       const GEOSPreparedGeometry* _prepared = NULL;
 
+      double _bbox[4];
+      const GEOSGeometry* _bbox_geom = NULL;    // geom the bounding box was computed for
+      bool _bbox_empty = false;
+
   private:
     template<class Archive>
     void save(Archive & ar, const unsigned int version) const
@@ -85,16 +110,15 @@ class geom_container
             return;
         }
 
-        GEOSWKBWriter* wkbw = GEOSWKBWriter_create();
+        // (de)serialization may happen on any thread, use its own context
+        GEOSWKBWriter* wkbw = thread_geos()->writer();
 
-        unsigned char* bin = GEOSWKBWriter_write(wkbw, geom, &size);
+        unsigned char* bin = GEOSWKBWriter_write_r(hdl, wkbw, geom, &size);
         ar & size;
         for (int i = 0; i < size; ++i) {
             ar & bin[i];
         }
-        GEOSFree(bin);
-
-        GEOSWKBWriter_destroy(wkbw);
+        GEOSFree_r(hdl, bin);
     }
 
     template<class Archive>
@@ -104,7 +128,7 @@ class geom_container
 
         ar & size;
         if (size == 0) {
-            geom = nullptr;
+            set_geom(nullptr);
             return;
         }
 
@@ -113,14 +137,8 @@ class geom_container
             ar & bin[i];
         }
 
-        if (!s_wkbr) {
-            GEOSWKBReader* wkbr = GEOSWKBReader_create();
-            geom = GEOSWKBReader_read(wkbr, bin, size);
-            GEOSWKBReader_destroy(wkbr);
-        }
-        else {
-            geom = GEOSWKBReader_read(s_wkbr, bin, size);
-        }
+        GEOSWKBReader* wkbr = thread_geos()->reader();
+        set_geom(GEOSWKBReader_read_r(hdl, wkbr, bin, size));
 
         delete [] bin;
     }
@@ -143,13 +161,9 @@ class edge : public geom_container
         start_node(other.start_node),
         end_node(other.end_node),
         next_left_edge(other.next_left_edge),
-        abs_next_left_edge(other.abs_next_left_edge),
         next_right_edge(other.next_right_edge),
-        abs_next_right_edge(other.abs_next_right_edge),
         left_face(other.left_face),
-        right_face(other.right_face),
-        prev_left_edge(other.prev_left_edge),
-        prev_right_edge(other.prev_right_edge) {};
+        right_face(other.right_face) {};
 
     ~edge() {}
 
@@ -158,12 +172,16 @@ class edge : public geom_container
     int end_node   = NULLint;
     int next_left_edge  = NULLint;
     int next_right_edge = NULLint;
-    int abs_next_left_edge  = NULLint;
-    int abs_next_right_edge = NULLint;
     int left_face  = NULLint;
     int right_face = NULLint;
-    int prev_left_edge  = NULLint;       // convenience
-    int prev_right_edge = NULLint;       // convenience
+
+    // derived from the links, as in PostGIS edge_data
+    int abs_next_left_edge() const {
+        return std::abs(next_left_edge);
+    }
+    int abs_next_right_edge() const {
+        return std::abs(next_right_edge);
+    }
 
   private:
     template<class Archive>
@@ -175,8 +193,12 @@ class edge : public geom_container
         ar & end_node;
         ar & next_left_edge;
         ar & next_right_edge;
-        ar & abs_next_left_edge;
-        ar & abs_next_right_edge;
+        if (version == 0) {
+            // derived fields, no longer stored
+            int abs_next_left_edge, abs_next_right_edge;
+            ar & abs_next_left_edge;
+            ar & abs_next_right_edge;
+        }
         ar & left_face;
         ar & right_face;
     }
@@ -294,4 +316,6 @@ void serialize(Archive& ar, OGREnvelope& g, const unsigned int version)
 } // namespace boost
 } // namespace serialization
 
+BOOST_CLASS_VERSION(cma::edge, 1)
+
 #endif // __CMA_TYPES_H
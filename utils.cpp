@@ -1,6 +1,7 @@
 #include <utils.h>
 
 #include <omp.h>
+#include <memory>
 #include <cstdio>
 #include <stdarg.h>
 #include <iostream>
@@ -9,17 +10,84 @@ using namespace std;
 
 namespace cma {
 
+thread_local GEOSContextHandle_t hdl = NULL;
+
+thread_local GEOSHelper* GEOSHelper::s_current = nullptr;
+
 void geos_message_function(const char *fmt, ...)
 {
-    va_list ap, ap2;
+    va_list ap;
     va_start(ap, fmt);
-    printf(fmt, ap);
+    vprintf(fmt, ap);
+    printf("\n");
     va_end (ap);
 }
 
+GEOSHelper::GEOSHelper()
+{
+    _hdl = GEOS_init_r();
+    assert (_hdl);
+    if (_hdl) {
+        GEOSContext_setNoticeMessageHandler_r(_hdl, _notice_handler, this);
+        GEOSContext_setErrorMessageHandler_r(_hdl, _error_handler, this);
+
+        wkbr = GEOSWKBReader_create_r(_hdl);
+        wktr = GEOSWKTReader_create_r(_hdl);
+        wkbw = GEOSWKBWriter_create_r(_hdl);
+        wktw = GEOSWKTWriter_create_r(_hdl);
+
+        GEOSWKTWriter_setRoundingPrecision_r(_hdl, wktw, 8);
+    }
+
+    _previous = s_current;
+    _previous_hdl = hdl;
+
+    s_current = this;
+    hdl = _hdl;
+}
+
+GEOSHelper::~GEOSHelper()
+{
+    if (wkbr) GEOSWKBReader_destroy_r(_hdl, wkbr);
+    if (wktr) GEOSWKTReader_destroy_r(_hdl, wktr);
+    if (wkbw) GEOSWKBWriter_destroy_r(_hdl, wkbw);
+    if (wktw) GEOSWKTWriter_destroy_r(_hdl, wktw);
+
+    finishGEOS_r(_hdl);
+
+    // helpers are strictly nested within a thread
+    assert (s_current == this);
+    s_current = _previous;
+    hdl = _previous_hdl;
+}
+
+void GEOSHelper::_error_handler(const char* message, void* userdata)
+{
+    GEOSHelper* geos = static_cast<GEOSHelper*>(userdata);
+    geos->_last_error = message;
+    cerr << "GEOS error: " << message << endl;
+}
+
+void GEOSHelper::_notice_handler(const char* message, void* userdata)
+{
+    GEOSHelper* geos = static_cast<GEOSHelper*>(userdata);
+    geos->_last_notice = message;
+    cout << "GEOS notice: " << message << endl;
+}
+
 void GEOSHelper::print_geom(const GEOSGeometry* geom)
 {
     cout << as_string(geom) << endl;
 }
 
+GEOSHelper* thread_geos()
+{
+    static thread_local unique_ptr<GEOSHelper> s_thread_geos;
+
+    if (!GEOSHelper::current()) {
+        s_thread_geos.reset(new GEOSHelper());
+    }
+    return GEOSHelper::current();
+}
+
 } // namespace cma
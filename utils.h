@@ -9,37 +9,32 @@
 
 namespace cma {
 
-extern GEOSContextHandle_t hdl;
+/**
+ * GEOS context of the calling thread. It is owned by the thread's current
+ * GEOSHelper (see thread_geos()) and must never be shared between threads.
+ */
+extern thread_local GEOSContextHandle_t hdl;
 
 void geos_message_function(const char *fmt, ...);
 
+/**
+ * Owns a GEOS context along with its readers/writers and error buffers.
+ *
+ * Creating a helper makes its context the calling thread's current one
+ * (cma::hdl); destroying it restores the previous one. Helpers are thus
+ * strictly per-thread and cannot be copied.
+ */
 class GEOSHelper
 {
 public:
-    GEOSHelper() {
-        hdl = initGEOS_r(geos_message_function, geos_message_function);
-        assert (hdl);
-        if (hdl) {
-            wkbr = GEOSWKBReader_create_r(hdl);
-            wktr = GEOSWKTReader_create_r(hdl);
-            wkbw = GEOSWKBWriter_create_r(hdl);
-            wktw = GEOSWKTWriter_create_r(hdl);
-
-            GEOSWKTWriter_setRoundingPrecision_r(hdl, wktw, 8);
-        }
-    }
-
-    ~GEOSHelper() {
-        if (wkbr) GEOSWKBReader_destroy_r(hdl, wkbr);
-        if (wktr) GEOSWKTReader_destroy_r(hdl, wktr);
-        if (wkbw) GEOSWKBWriter_destroy_r(hdl, wkbw);
-        if (wktw) GEOSWKTWriter_destroy_r(hdl, wktw);
+    GEOSHelper();
+    ~GEOSHelper();
 
-        finishGEOS_r(hdl);
-    }
+    GEOSHelper(const GEOSHelper&) = delete;
+    GEOSHelper& operator=(const GEOSHelper&) = delete;
 
     GEOSContextHandle_t handle() const {
-        return hdl;
+        return _hdl;
     }
 
     GEOSWKBReader* reader() {
@@ -60,32 +55,78 @@ public:
 
     std::string as_string(const GEOSGeometry* geom) {
         assert (geom);
-        // GEOSWKTWriter_setRoundingPrecision_r(hdl, text_writer(), 15);
-        char* wkt_c = GEOSWKTWriter_write_r(hdl, text_writer(), geom);
+        // GEOSWKTWriter_setRoundingPrecision_r(_hdl, text_writer(), 15);
+        char* wkt_c = GEOSWKTWriter_write_r(_hdl, text_writer(), geom);
         std::string wkt(wkt_c);
-        GEOSFree_r(hdl, wkt_c);
+        GEOSFree_r(_hdl, wkt_c);
         return wkt;
     }
 
     std::string as_hex_string(const GEOSGeometry* geom) {
         assert (geom);
-        // GEOSWKTWriter_setRoundingPrecision_r(hdl, text_writer(), 15);
+        // GEOSWKTWriter_setRoundingPrecision_r(_hdl, text_writer(), 15);
         size_t size;
-        unsigned char* hex_c = GEOSWKBWriter_writeHEX_r(hdl, writer(), geom, &size);
+        unsigned char* hex_c = GEOSWKBWriter_writeHEX_r(_hdl, writer(), geom, &size);
         std::string hex((char*)hex_c, size);
-        GEOSFree_r(hdl, hex_c);
+        GEOSFree_r(_hdl, hex_c);
         return hex;
     }
 
     void print_geom(const GEOSGeometry* geom);
 
+    /**
+     * Last error/notice message emitted by GEOS in this context.
+     */
+    const std::string& last_error() const {
+        return _last_error;
+    }
+
+    const std::string& last_notice() const {
+        return _last_notice;
+    }
+
+    void clear_messages() {
+        _last_error.clear();
+        _last_notice.clear();
+    }
+
+    /**
+     * The calling thread's current helper (nullptr if there is none).
+     */
+    static GEOSHelper* current() {
+        return s_current;
+    }
+
 private:
+    static void _error_handler(const char* message, void* userdata);
+    static void _notice_handler(const char* message, void* userdata);
+
+    GEOSContextHandle_t _hdl = NULL;
+
     GEOSWKBReader* wkbr = NULL;
     GEOSWKTReader* wktr = NULL;
     GEOSWKBWriter* wkbw = NULL;
     GEOSWKTWriter* wktw = NULL;
+
+    std::string _last_error;
+    std::string _last_notice;
+
+    /**
+     * Helper (and context) that was current before this one.
+     */
+    GEOSHelper* _previous = nullptr;
+    GEOSContextHandle_t _previous_hdl = NULL;
+
+    static thread_local GEOSHelper* s_current;
 };
 
+/**
+ * Return the calling thread's GEOS helper, creating one that lives as long
+ * as the thread if needed. This must be called before any GEOS operation in
+ * a thread other than the main one (e.g. at the top of OpenMP regions).
+ */
+GEOSHelper* thread_geos();
+
 template<class C, class T>
 bool _is_in(T hay, const C& stack)
 {
@@ -100,6 +100,9 @@ int prepare_zones(string& postgres_connect_str, GEOSHelper& geos, const GEOSGeom
 
     #pragma omp parallel for num_threads(4) reduction(+:sum_nb_lines)
     for (int i = 0; i < 4; ++i) {
+        // each thread needs its own GEOS context
+        thread_geos();
+
         PG db(postgres_connect_str);
         int row, col;
         switch(i)
@@ -127,7 +130,7 @@ int prepare_zones(string& postgres_connect_str, GEOSHelper& geos, const GEOSGeom
          */
         GEOSGeometry* geom_extent = OGREnvelope2GEOSGeom(local_extent);
         string pg_geom = db.build_pg_geom(geom_extent);
-        GEOSGeom_destroy_r(geos.handle(), geom_extent);
+        GEOSGeom_destroy_r(hdl, geom_extent);
 
         ostringstream oss;
         oss << "SELECT COUNT(1) FROM way WHERE "
@@ -21,8 +21,6 @@ class Topology;
 typedef std::array<int, 4> group_t;
 typedef std::pair<int, group_t> depth_group_t;
 
-extern GEOSContextHandle_t hdl;
-
 int prepare_zones(
     std::string& postgres_connect_str,
     GEOSHelper& geos,